@@ -3,7 +3,11 @@ if( NOT TARGET FFmpegMovieWriter )
 		"${CMAKE_CURRENT_LIST_DIR}/../.." ABSOLUTE )
 
 	list( APPEND FFMPEGMOVIEWRITER_SOURCES
+		${FFMPEGMOVIEWRITER_ROOT_PATH}/src/FFmpegMemoryGovernor.cpp
+		${FFMPEGMOVIEWRITER_ROOT_PATH}/src/FFmpegMovieReader.cpp
 		${FFMPEGMOVIEWRITER_ROOT_PATH}/src/FFmpegMovieWriter.cpp
+		${FFMPEGMOVIEWRITER_ROOT_PATH}/src/FFmpegTracer.cpp
+		${FFMPEGMOVIEWRITER_ROOT_PATH}/src/FFmpegUtils.cpp
 	)
 
 	add_library( FFmpegMovieWriter ${FFMPEGMOVIEWRITER_SOURCES} )
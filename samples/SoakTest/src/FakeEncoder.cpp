@@ -0,0 +1,667 @@
+/*
+ Stand-in for the ffmpeg executable used by the SoakTest harness. It accepts
+ the command line FFmpegMovieWriter builds, reads the raw video pipe and the
+ matroska audio pipe and verifies what arrives instead of encoding it.
+
+ Video frames are expected to carry their sequence number in the first and
+ the last 8 bytes, which catches torn frames, duplicates and gaps. Audio
+ blocks are expected to continue the timestamps of their track. The results
+ are written as key=value lines to the output path.
+
+ Behaviour is configured through the environment:
+   FAKE_ENCODER_FPS          video frames read per second, 0 reads as fast as possible
+   FAKE_ENCODER_STALL_EVERY  stall after every n video frames
+   FAKE_ENCODER_STALL_MS     length of a stall
+   FAKE_ENCODER_CRASH_AFTER  abort after n video frames
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Input
+{
+	std::string mPath;
+	std::string mFormat;
+	std::string mPixelFormat;
+	int mWidth = 0;
+	int mHeight = 0;
+	int mSampleRate = 0;
+	int mNumChannels = 0;
+	double mFrameRate = 0.0;
+};
+
+struct VideoResult
+{
+	uint64_t mNumFrames = 0;
+	uint64_t mNumBytes = 0;
+	uint64_t mNumPartialBytes = 0;
+	uint64_t mNumTornFrames = 0;
+	uint64_t mNumDuplicates = 0;
+	uint64_t mNumGaps = 0;
+	uint64_t mNumStalls = 0;
+};
+
+struct AudioTrack
+{
+	uint64_t mNumChannels = 0;
+	double mSampleRate = 0.0;
+	uint64_t mNumSamples = 0;
+	uint64_t mStartTimestamp = 0;
+	bool mStarted = false;
+};
+
+struct AudioResult
+{
+	//! Keyed by the matroska track number.
+	std::map< uint64_t, AudioTrack > mTracks;
+	uint64_t mNumBytes = 0;
+	uint64_t mNumPartialBytes = 0;
+	uint64_t mNumTimestampErrors = 0;
+	uint64_t mNumUnknownBlocks = 0;
+	bool mValid = true;
+};
+
+long getEnv( const char *name, long defaultValue )
+{
+	const char *value = ::getenv( name );
+	return value ? ::strtol( value, nullptr, 10 ) : defaultValue;
+}
+
+//! Bytes per frame of the raw pixel formats FFmpegMovieWriter sends.
+size_t getFrameSize( const Input &input )
+{
+	const size_t numPixels = size_t( input.mWidth ) * input.mHeight;
+	const std::string &pf = input.mPixelFormat;
+
+	if ( pf == "rgb24" || pf == "bgr24" )
+	{
+		return numPixels * 3;
+	}
+	if ( pf == "rgb48le" || pf == "gbrp16le" )
+	{
+		return numPixels * 6;
+	}
+	if ( pf == "yuv420p10le" || pf == "p010le" )
+	{
+		const size_t chromaPixels = size_t( ( input.mWidth + 1 ) / 2 ) * ( ( input.mHeight + 1 ) / 2 );
+		return ( numPixels + chromaPixels * 2 ) * 2;
+	}
+	return numPixels * 4;
+}
+
+//! The sequence number stamp is only meaningful for the 8-bit formats that are sent unchanged.
+bool isStamped( const Input &input )
+{
+	const std::string &pf = input.mPixelFormat;
+	return pf != "rgb48le" && pf != "gbrp16le" && pf != "yuv420p10le" && pf != "p010le";
+}
+
+//! Reads up to \a size bytes, returns fewer only at the end of the stream.
+size_t readFully( int fd, uint8_t *data, size_t size )
+{
+	size_t offset = 0;
+	while ( offset < size )
+	{
+		ssize_t n = ::read( fd, data + offset, size - offset );
+		if ( n > 0 )
+		{
+			offset += n;
+		}
+		else
+		if ( n == 0 || errno != EINTR )
+		{
+			break;
+		}
+	}
+	return offset;
+}
+
+void videoThreadFn( Input input, VideoResult *result, int progressFd )
+{
+	int fd = ::open( input.mPath.c_str(), O_RDONLY );
+	if ( fd < 0 )
+	{
+		::fprintf( stderr, "fake encoder: cannot open %s\n", input.mPath.c_str() );
+		return;
+	}
+
+	const long fps = getEnv( "FAKE_ENCODER_FPS", 0 );
+	const long stallEvery = getEnv( "FAKE_ENCODER_STALL_EVERY", 0 );
+	const long stallMs = getEnv( "FAKE_ENCODER_STALL_MS", 0 );
+	const long crashAfter = getEnv( "FAKE_ENCODER_CRASH_AFTER", 0 );
+
+	const size_t frameSize = getFrameSize( input );
+	const bool stamped = isStamped( input ) && frameSize >= 16;
+	std::vector< uint8_t > frame( frameSize );
+
+	uint64_t expectedId = 0;
+	Clock::time_point next = Clock::now();
+
+	for ( ;; )
+	{
+		size_t n = readFully( fd, frame.data(), frameSize );
+		result->mNumBytes += n;
+		if ( n < frameSize )
+		{
+			result->mNumPartialBytes = n;
+			break;
+		}
+
+		if ( stamped )
+		{
+			uint64_t head, tail;
+			std::memcpy( &head, frame.data(), sizeof( head ) );
+			std::memcpy( &tail, frame.data() + frameSize - sizeof( tail ), sizeof( tail ) );
+			if ( head != tail )
+			{
+				result->mNumTornFrames++;
+			}
+			else
+			if ( head < expectedId )
+			{
+				result->mNumDuplicates++;
+			}
+			else
+			{
+				result->mNumGaps += head - expectedId;
+				expectedId = head + 1;
+			}
+		}
+
+		const uint64_t numFrames = ++result->mNumFrames;
+
+		if ( progressFd >= 0 && numFrames % 10 == 0 )
+		{
+			std::string progress = "frame=" + std::to_string( numFrames ) + "\nprogress=continue\n";
+			ssize_t unused = ::write( progressFd, progress.data(), progress.size() );
+			(void)unused;
+		}
+
+		if ( crashAfter > 0 && numFrames >= (uint64_t)crashAfter )
+		{
+			::fprintf( stderr, "fake encoder: crashing after %llu frames\n", (unsigned long long)numFrames );
+			::abort();
+		}
+
+		if ( stallEvery > 0 && numFrames % stallEvery == 0 )
+		{
+			result->mNumStalls++;
+			std::this_thread::sleep_for( std::chrono::milliseconds( stallMs ) );
+			next = Clock::now();
+		}
+
+		if ( fps > 0 )
+		{
+			next += std::chrono::microseconds( 1000000 / fps );
+			std::this_thread::sleep_until( next );
+		}
+	}
+
+	::close( fd );
+}
+
+//! Buffered reader for the matroska audio stream.
+class StreamReader
+{
+ public:
+	StreamReader( int fd ) : mFd( fd ), mBuffer( 64 * 1024 ) {}
+
+	bool read( uint8_t *data, size_t size )
+	{
+		while ( size > 0 )
+		{
+			if ( mBegin == mEnd && ! fill() )
+			{
+				return false;
+			}
+			const size_t n = std::min( size, mEnd - mBegin );
+			std::memcpy( data, mBuffer.data() + mBegin, n );
+			mBegin += n;
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	//! Returns the number of bytes skipped, fewer than \a size only at the end of the stream.
+	uint64_t skip( uint64_t size )
+	{
+		uint64_t skipped = 0;
+		while ( skipped < size )
+		{
+			if ( mBegin == mEnd && ! fill() )
+			{
+				break;
+			}
+			const size_t n = size_t( std::min< uint64_t >( size - skipped, mEnd - mBegin ) );
+			mBegin += n;
+			skipped += n;
+		}
+		return skipped;
+	}
+
+	uint64_t getNumBytes() const { return mNumBytes; }
+
+ private:
+	bool fill()
+	{
+		for ( ;; )
+		{
+			ssize_t n = ::read( mFd, mBuffer.data(), mBuffer.size() );
+			if ( n < 0 && errno == EINTR )
+			{
+				continue;
+			}
+			if ( n <= 0 )
+			{
+				return false;
+			}
+			mBegin = 0;
+			mEnd = size_t( n );
+			mNumBytes += n;
+			return true;
+		}
+	}
+
+	int mFd;
+	std::vector< uint8_t > mBuffer;
+	size_t mBegin = 0;
+	size_t mEnd = 0;
+	uint64_t mNumBytes = 0;
+};
+
+//! Reads an EBML variable length integer, \a keepMarker keeps the length bits for element ids.
+bool readVarInt( StreamReader *reader, uint64_t *value, bool keepMarker, bool *unknown = nullptr )
+{
+	uint8_t first;
+	if ( ! reader->read( &first, 1 ) || first == 0 )
+	{
+		return false;
+	}
+	size_t length = 1;
+	while ( ! ( first & ( 0x80 >> ( length - 1 ) ) ) )
+	{
+		length++;
+	}
+	uint64_t v = keepMarker ? first : first & ( 0xFF >> length );
+	bool allOnes = v == uint64_t( 0xFF >> length );
+	for ( size_t i = 1; i < length; i++ )
+	{
+		uint8_t byte;
+		if ( ! reader->read( &byte, 1 ) )
+		{
+			return false;
+		}
+		v = ( v << 8 ) | byte;
+		allOnes = allOnes && byte == 0xFF;
+	}
+	*value = v;
+	if ( unknown )
+	{
+		*unknown = allOnes;
+	}
+	return true;
+}
+
+bool readBigEndian( StreamReader *reader, uint64_t size, uint64_t *value )
+{
+	uint8_t data[ 8 ];
+	if ( size > 8 || ! reader->read( data, size_t( size ) ) )
+	{
+		return false;
+	}
+	*value = 0;
+	for ( uint64_t i = 0; i < size; i++ )
+	{
+		*value = ( *value << 8 ) | data[ i ];
+	}
+	return true;
+}
+
+//! Walks the live matroska stream FFmpegMovieWriter sends, masters are
+//! entered without tracking their end since the stream is only read once.
+//! Like ffmpeg's demuxer, \a headerRead is only set at the first cluster.
+void audioThreadFn( Input input, AudioResult *result, std::promise< void > *headerRead )
+{
+	int fd = ::open( input.mPath.c_str(), O_RDONLY );
+	if ( fd < 0 )
+	{
+		::fprintf( stderr, "fake encoder: cannot open %s\n", input.mPath.c_str() );
+		headerRead->set_value();
+		return;
+	}
+	bool headerDone = false;
+
+	StreamReader reader( fd );
+	AudioTrack entry;
+	uint64_t entryNumber = 0;
+	uint64_t clusterTimestamp = 0;
+	std::vector< uint8_t > block;
+
+	for ( ;; )
+	{
+		uint64_t id, size;
+		bool unknown = false;
+		if ( ! readVarInt( &reader, &id, true ) )
+		{
+			break;
+		}
+		if ( ! readVarInt( &reader, &size, false, &unknown ) )
+		{
+			result->mValid = false;
+			break;
+		}
+
+		if ( id == 0x1F43B675 && entryNumber )
+		{
+			// the tracks end at the first cluster
+			result->mTracks[ entryNumber ] = entry;
+			entryNumber = 0;
+		}
+		if ( id == 0x1F43B675 && ! headerDone )
+		{
+			headerDone = true;
+			headerRead->set_value();
+		}
+		if ( id == 0x18538067 || id == 0x1654AE6B || id == 0xE1 || id == 0x1F43B675 )
+		{
+			// segment, tracks, track audio and cluster
+			continue;
+		}
+		if ( unknown )
+		{
+			result->mValid = false;
+			break;
+		}
+
+		uint64_t value = 0;
+		bool ok = true;
+		switch ( id )
+		{
+			case 0xAE:
+				// track entry, its children follow
+				if ( entryNumber )
+				{
+					result->mTracks[ entryNumber ] = entry;
+				}
+				entry = AudioTrack();
+				entryNumber = 0;
+				break;
+
+			case 0xD7:
+				ok = readBigEndian( &reader, size, &entryNumber );
+				break;
+
+			case 0x9F:
+				ok = readBigEndian( &reader, size, &entry.mNumChannels );
+				break;
+
+			case 0xB5:
+				ok = readBigEndian( &reader, size, &value );
+				if ( ok && size == 8 )
+				{
+					std::memcpy( &entry.mSampleRate, &value, sizeof( value ) );
+				}
+				break;
+
+			case 0xE7:
+				ok = readBigEndian( &reader, size, &clusterTimestamp );
+				break;
+
+			case 0xA3:
+			{
+				if ( entryNumber )
+				{
+					result->mTracks[ entryNumber ] = entry;
+					entryNumber = 0;
+				}
+				uint64_t trackNumber;
+				uint8_t timing[ 3 ];
+				if ( size < 4 || ! readVarInt( &reader, &trackNumber, false ) || ! reader.read( timing, 3 ) )
+				{
+					ok = false;
+					break;
+				}
+				const uint64_t payloadSize = size - 4;
+				block.resize( size_t( payloadSize ) );
+				if ( ! reader.read( block.data(), block.size() ) )
+				{
+					result->mNumPartialBytes = payloadSize;
+					ok = false;
+					break;
+				}
+				auto it = result->mTracks.find( trackNumber );
+				if ( it == result->mTracks.end() || it->second.mNumChannels == 0 || it->second.mSampleRate <= 0.0 )
+				{
+					result->mNumUnknownBlocks++;
+					break;
+				}
+
+				AudioTrack &track = it->second;
+				const uint64_t timestamp = clusterTimestamp + int16_t( ( timing[ 0 ] << 8 ) | timing[ 1 ] );
+				if ( ! track.mStarted )
+				{
+					track.mStarted = true;
+					track.mStartTimestamp = timestamp;
+				}
+				// the writer truncates the block timestamps to milliseconds
+				const uint64_t expected = track.mStartTimestamp + uint64_t( track.mNumSamples * 1000 / track.mSampleRate );
+				if ( timestamp + 1 < expected || timestamp > expected + 1 )
+				{
+					result->mNumTimestampErrors++;
+				}
+				track.mNumSamples += payloadSize / ( sizeof( float ) * track.mNumChannels );
+				break;
+			}
+
+			default:
+				ok = reader.skip( size ) == size;
+				break;
+		}
+		if ( ! ok )
+		{
+			break;
+		}
+	}
+	result->mNumBytes = reader.getNumBytes();
+	if ( ! headerDone )
+	{
+		headerRead->set_value();
+	}
+
+	::close( fd );
+}
+
+} // anonymous namespace
+
+int main( int argc, char **argv )
+{
+	::signal( SIGPIPE, SIG_IGN );
+
+	// the writer checks the filters of its filter chain, which the fake
+	// encoder accepts without running them
+	if ( argc > 1 && std::string( argv[ argc - 1 ] ) == "-filters" )
+	{
+		::printf( "Filters:\n"
+				" ------\n"
+				" ... drawtext          V->V       Draw text on top of video frames.\n"
+				" ... fps               V->V       Force constant framerate.\n"
+				" ... overlay           VV->V      Overlay a video source on top of the input.\n"
+				" ... pad               V->V       Pad the input video.\n"
+				" ... scale             V->V       Scale the input video size.\n" );
+		return 0;
+	}
+
+	std::vector< Input > inputs;
+	Input current;
+	std::string progressPath;
+	// the output always comes last
+	const std::string outputPath = argc > 1 ? argv[ argc - 1 ] : "";
+
+	for ( int i = 1; i < argc - 1; i++ )
+	{
+		const std::string arg = argv[ i ];
+		const bool hasValue = i + 2 < argc;
+
+		if ( arg == "-progress" && hasValue )
+		{
+			progressPath = argv[ ++i ];
+		}
+		else
+		if ( arg == "-f" && hasValue )
+		{
+			current.mFormat = argv[ ++i ];
+		}
+		else
+		if ( arg == "-pix_fmt" && hasValue )
+		{
+			current.mPixelFormat = argv[ ++i ];
+		}
+		else
+		if ( arg == "-s" && hasValue )
+		{
+			::sscanf( argv[ ++i ], "%dx%d", &current.mWidth, &current.mHeight );
+		}
+		else
+		if ( arg == "-ar" && hasValue )
+		{
+			current.mSampleRate = ::atoi( argv[ ++i ] );
+		}
+		else
+		if ( arg == "-ac" && hasValue )
+		{
+			current.mNumChannels = ::atoi( argv[ ++i ] );
+		}
+		else
+		if ( arg == "-r" && hasValue )
+		{
+			current.mFrameRate = ::atof( argv[ ++i ] );
+		}
+		else
+		if ( arg == "-i" && hasValue )
+		{
+			current.mPath = argv[ ++i ];
+			inputs.push_back( current );
+			current = Input();
+		}
+		else
+		if ( hasValue && argv[ i + 1 ][ 0 ] != '-' )
+		{
+			// skip the value of options we do not care about, flags such as
+			// -y and -an are followed by another option
+			i++;
+		}
+	}
+
+	int progressFd = -1;
+	if ( ! progressPath.empty() )
+	{
+		progressFd = ::open( progressPath.c_str(), O_WRONLY );
+	}
+
+	VideoResult videoResult;
+	AudioResult audioResult;
+	Input videoInput;
+	std::vector< std::thread > threads;
+	std::vector< std::unique_ptr< std::promise< void > > > headers;
+
+	// inputs are opened in order, a matroska input blocks the following ones
+	// until its header is read
+	for ( const auto &input : inputs )
+	{
+		if ( input.mFormat == "rawvideo" )
+		{
+			videoInput = input;
+			threads.emplace_back( videoThreadFn, input, &videoResult, progressFd );
+		}
+		else
+		if ( input.mFormat == "matroska" )
+		{
+			headers.emplace_back( new std::promise< void >() );
+			threads.emplace_back( audioThreadFn, input, &audioResult, headers.back().get() );
+			headers.back()->get_future().wait();
+		}
+		// other inputs, such as overlay images, are not pipes
+	}
+
+	for ( auto &thread : threads )
+	{
+		thread.join();
+	}
+
+	if ( progressFd >= 0 )
+	{
+		std::string progress = "frame=" + std::to_string( videoResult.mNumFrames ) + "\nprogress=end\n";
+		ssize_t unused = ::write( progressFd, progress.data(), progress.size() );
+		(void)unused;
+		::close( progressFd );
+	}
+
+	FILE *out = stderr;
+	if ( ! outputPath.empty() && outputPath.compare( 0, 5, "pipe:" ) != 0 )
+	{
+		out = ::fopen( outputPath.c_str(), "w" );
+		if ( ! out )
+		{
+			::fprintf( stderr, "fake encoder: cannot write %s\n", outputPath.c_str() );
+			return 1;
+		}
+	}
+
+	// the first track paces the video
+	const AudioTrack firstTrack = audioResult.mTracks.empty() ? AudioTrack() : audioResult.mTracks.begin()->second;
+	double drift = 0.0;
+	if ( videoInput.mFrameRate > 0.0 && firstTrack.mSampleRate > 0.0 )
+	{
+		drift = double( firstTrack.mNumSamples ) / firstTrack.mSampleRate -
+			double( videoResult.mNumFrames ) / videoInput.mFrameRate;
+	}
+
+	::fprintf( out, "video_frames=%llu\n", (unsigned long long)videoResult.mNumFrames );
+	::fprintf( out, "video_bytes=%llu\n", (unsigned long long)videoResult.mNumBytes );
+	::fprintf( out, "video_partial_bytes=%llu\n", (unsigned long long)videoResult.mNumPartialBytes );
+	::fprintf( out, "video_torn=%llu\n", (unsigned long long)videoResult.mNumTornFrames );
+	::fprintf( out, "video_duplicates=%llu\n", (unsigned long long)videoResult.mNumDuplicates );
+	::fprintf( out, "video_gaps=%llu\n", (unsigned long long)videoResult.mNumGaps );
+	::fprintf( out, "video_stalls=%llu\n", (unsigned long long)videoResult.mNumStalls );
+	::fprintf( out, "audio_samples=%llu\n", (unsigned long long)firstTrack.mNumSamples );
+	::fprintf( out, "audio_bytes=%llu\n", (unsigned long long)audioResult.mNumBytes );
+	::fprintf( out, "audio_partial_bytes=%llu\n", (unsigned long long)audioResult.mNumPartialBytes );
+	::fprintf( out, "audio_tracks=%llu\n", (unsigned long long)audioResult.mTracks.size() );
+	for ( const auto &track : audioResult.mTracks )
+	{
+		::fprintf( out, "audio_track%llu_samples=%llu\n", (unsigned long long)track.first,
+				(unsigned long long)track.second.mNumSamples );
+		::fprintf( out, "audio_track%llu_start_ms=%llu\n", (unsigned long long)track.first,
+				(unsigned long long)track.second.mStartTimestamp );
+	}
+	::fprintf( out, "audio_timestamp_errors=%llu\n", (unsigned long long)audioResult.mNumTimestampErrors );
+	::fprintf( out, "audio_unknown_blocks=%llu\n", (unsigned long long)audioResult.mNumUnknownBlocks );
+	::fprintf( out, "audio_stream_valid=%d\n", audioResult.mValid ? 1 : 0 );
+	::fprintf( out, "av_drift=%f\n", drift );
+
+	if ( out != stderr )
+	{
+		::fclose( out );
+	}
+	return 0;
+}
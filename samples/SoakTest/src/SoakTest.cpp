@@ -0,0 +1,413 @@
+/*
+ Headless soak and stress harness for FFmpegMovieWriter. It points the writer
+ at the FakeEncoder stand-in, drives addFrame() and addAudioBuffer() at the
+ requested rates for long runs and reports per run:
+   - frames dropped, repeated and skipped by the writer and duplicates, gaps
+     and torn frames seen by the encoder
+   - A/V drift of what reached the encoder
+   - peak and current RSS, peak and remaining thread count
+   - the longest addFrame() call and the shutdown time
+
+ Usage:
+   SoakTest [--seconds 60] [--runs 1] [--fps 30] [--width 1280] [--height 720]
+            [--audio-rate 44100] [--audio-block 512] [--audio-tracks 1] [--no-audio]
+            [--no-audio-buffers] [--streaming]
+            [--unpaced] [--encoder path] [--encoder-fps 0] [--stall-every 0]
+            [--stall-ms 0] [--crash-after 0] [--output soak.txt]
+
+ The process exits with a non-zero status when the encoder sees torn frames
+ or more duplicates and gaps than the writer accounts for, the drift exceeds
+ one frame, the audio timestamps of a track are not continuous or threads
+ are left behind, so it can gate performance regressions. Audio tracks after
+ the first one are recorded in mono. --no-audio-buffers records the audio
+ tracks without ever adding a buffer, finalize() has to return regardless
+ and a run that takes longer than kFinalizeTimeout to finalize fails.
+*/
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined( __APPLE__ )
+#include <mach/mach.h>
+#else
+#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cinder/Log.h"
+#include "cinder/Surface.h"
+#include "cinder/audio/Buffer.h"
+
+#include "FFmpegMovieWriter.h"
+
+using namespace ci;
+using namespace std;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const std::chrono::seconds kFinalizeTimeout( 30 );
+
+struct Options
+{
+	double mSeconds = 60.0;
+	int mNumRuns = 1;
+	float mFrameRate = 30.0f;
+	int32_t mWidth = 1280;
+	int32_t mHeight = 720;
+	size_t mAudioSampleRate = 44100;
+	size_t mAudioBlockSize = 512;
+	size_t mNumAudioTracks = 1;
+	bool mRecordAudio = true;
+	bool mAddAudioBuffers = true;
+	bool mStreaming = false;
+	bool mPaced = true;
+	fs::path mPathEncoder;
+	fs::path mPathOutput = "soak.txt";
+	std::string mEncoderFps = "0";
+	std::string mStallEvery = "0";
+	std::string mStallMs = "0";
+	std::string mCrashAfter = "0";
+};
+
+struct RunResult
+{
+	size_t mNumFramesSubmitted = 0;
+	size_t mNumFramesDropped = 0;
+	size_t mNumFramesRepeated = 0;
+	size_t mNumFramesSkipped = 0;
+	size_t mNumFramesAllocated = 0;
+	double mMaxAddFrameMs = 0.0;
+	double mShutdownMs = 0.0;
+	size_t mPeakThreads = 0;
+	mndl::FFmpegMovieWriter::FinalizeResult mFinalize;
+	std::map< std::string, std::string > mEncoder;
+};
+
+size_t getNumThreads()
+{
+#if defined( __APPLE__ )
+	thread_act_array_t threads;
+	mach_msg_type_number_t count = 0;
+	if ( task_threads( mach_task_self(), &threads, &count ) != KERN_SUCCESS )
+	{
+		return 0;
+	}
+	for ( mach_msg_type_number_t i = 0; i < count; i++ )
+	{
+		mach_port_deallocate( mach_task_self(), threads[ i ] );
+	}
+	vm_deallocate( mach_task_self(), (vm_address_t)threads, sizeof( *threads ) * count );
+	return count;
+#else
+	size_t count = 0;
+	if ( DIR *dir = ::opendir( "/proc/self/task" ) )
+	{
+		while ( struct dirent *entry = ::readdir( dir ) )
+		{
+			if ( entry->d_name[ 0 ] != '.' )
+			{
+				count++;
+			}
+		}
+		::closedir( dir );
+	}
+	return count;
+#endif
+}
+
+//! Resident set size in kilobytes.
+size_t getCurrentRss()
+{
+#if defined( __APPLE__ )
+	mach_task_basic_info info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if ( task_info( mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count ) != KERN_SUCCESS )
+	{
+		return 0;
+	}
+	return info.resident_size / 1024;
+#else
+	long pages = 0;
+	std::ifstream statm( "/proc/self/statm" );
+	statm >> pages >> pages;
+	return size_t( pages ) * ::sysconf( _SC_PAGESIZE ) / 1024;
+#endif
+}
+
+size_t getPeakRss()
+{
+	struct rusage usage;
+	::getrusage( RUSAGE_SELF, &usage );
+#if defined( __APPLE__ )
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+//! Writes \a id to the first and last 8 bytes of the frame, which the fake encoder checks.
+void stampFrame( const Surface8uRef &surface, uint64_t id )
+{
+	uint8_t *first = surface->getData();
+	uint8_t *lastRow = surface->getData( ivec2( 0, surface->getHeight() - 1 ) );
+	const size_t rowSize = surface->getWidth() * surface->getPixelInc();
+	std::memcpy( first, &id, sizeof( id ) );
+	std::memcpy( lastRow + rowSize - sizeof( id ), &id, sizeof( id ) );
+}
+
+std::map< std::string, std::string > readReport( const fs::path &path )
+{
+	std::map< std::string, std::string > report;
+	std::ifstream file( path.string() );
+	std::string line;
+	while ( std::getline( file, line ) )
+	{
+		size_t eq = line.find( '=' );
+		if ( eq != std::string::npos )
+		{
+			report[ line.substr( 0, eq ) ] = line.substr( eq + 1 );
+		}
+	}
+	return report;
+}
+
+RunResult run( const Options &options, int runId )
+{
+	::setenv( "FAKE_ENCODER_FPS", options.mEncoderFps.c_str(), 1 );
+	::setenv( "FAKE_ENCODER_STALL_EVERY", options.mStallEvery.c_str(), 1 );
+	::setenv( "FAKE_ENCODER_STALL_MS", options.mStallMs.c_str(), 1 );
+	::setenv( "FAKE_ENCODER_CRASH_AFTER", options.mCrashAfter.c_str(), 1 );
+
+	auto format = mndl::FFmpegMovieWriter::Format()
+		.ffmpegPath( options.mPathEncoder )
+		.frameRate( options.mFrameRate )
+		.recordAudio( options.mRecordAudio )
+		.audioSampleRate( options.mAudioSampleRate )
+		.numAudioInputChannels( 2 );
+	if ( options.mNumAudioTracks > 1 )
+	{
+		format.audioTrack( options.mAudioSampleRate, 2 );
+		for ( size_t i = 1; i < options.mNumAudioTracks; i++ )
+		{
+			format.audioTrack( options.mAudioSampleRate, 1 );
+		}
+	}
+	if ( options.mStreaming )
+	{
+		format.streaming();
+	}
+
+	fs::path path = options.mPathOutput;
+	path.replace_extension( "." + std::to_string( runId ) + path.extension().string() );
+	fs::remove( path );
+
+	RunResult result;
+	auto writer = mndl::FFmpegMovieWriter::create( path, options.mWidth, options.mHeight, format );
+
+	// surfaces come back to the pool once the writer releases them
+	std::vector< Surface8uRef > pool;
+	audio::Buffer audioBuffer( options.mAudioBlockSize, 2 );
+
+	const auto frameDuration = std::chrono::duration< double >( 1.0 / options.mFrameRate );
+	const uint64_t numFrames = uint64_t( options.mSeconds * options.mFrameRate );
+	const Clock::time_point start = Clock::now();
+	uint64_t numAudioFrames = 0;
+
+	for ( uint64_t id = 0; id < numFrames; id++ )
+	{
+		Surface8uRef surface;
+		for ( const auto &s : pool )
+		{
+			if ( s.use_count() == 1 )
+			{
+				surface = s;
+				break;
+			}
+		}
+		if ( ! surface )
+		{
+			surface = Surface8u::create( options.mWidth, options.mHeight, false );
+			pool.push_back( surface );
+			result.mNumFramesAllocated++;
+		}
+		stampFrame( surface, id );
+
+		const Clock::time_point addStart = Clock::now();
+		writer->addFrame( surface );
+		result.mMaxAddFrameMs = std::max( result.mMaxAddFrameMs,
+				std::chrono::duration< double, std::milli >( Clock::now() - addStart ).count() );
+		result.mNumFramesSubmitted++;
+
+		if ( options.mRecordAudio && options.mAddAudioBuffers )
+		{
+			// keeps the submitted audio within a block of the video clock
+			const uint64_t targetAudioFrames = uint64_t( double( id + 1 ) * options.mAudioSampleRate / options.mFrameRate );
+			while ( numAudioFrames + options.mAudioBlockSize <= targetAudioFrames )
+			{
+				for ( size_t track = 0; track < options.mNumAudioTracks; track++ )
+				{
+					writer->addAudioBuffer( track, &audioBuffer );
+				}
+				numAudioFrames += options.mAudioBlockSize;
+			}
+		}
+
+		result.mPeakThreads = std::max( result.mPeakThreads, getNumThreads() );
+
+		if ( options.mPaced )
+		{
+			std::this_thread::sleep_until( start + std::chrono::duration_cast< Clock::duration >( frameDuration * double( id + 1 ) ) );
+		}
+	}
+
+	const Clock::time_point shutdownStart = Clock::now();
+	auto finalized = writer->finalize();
+	if ( finalized.wait_for( kFinalizeTimeout ) != std::future_status::ready )
+	{
+		std::fprintf( stderr, "finalize did not return in %lld seconds\n", (long long)kFinalizeTimeout.count() );
+		std::_Exit( 1 );
+	}
+	result.mFinalize = finalized.get();
+	result.mNumFramesDropped = writer->getNumVideoFramesDropped();
+	result.mNumFramesRepeated = writer->getNumVideoFramesRepeated();
+	result.mNumFramesSkipped = writer->getNumVideoFramesSkipped();
+	writer.reset();
+	result.mShutdownMs = std::chrono::duration< double, std::milli >( Clock::now() - shutdownStart ).count();
+
+	result.mEncoder = readReport( path );
+	return result;
+}
+
+bool parseOptions( int argc, char **argv, Options *options )
+{
+	for ( int i = 1; i < argc; i++ )
+	{
+		const std::string arg = argv[ i ];
+		const char *value = i + 1 < argc ? argv[ i + 1 ] : nullptr;
+
+		if ( arg == "--no-audio" ) { options->mRecordAudio = false; continue; }
+		if ( arg == "--no-audio-buffers" ) { options->mAddAudioBuffers = false; continue; }
+		if ( arg == "--streaming" ) { options->mStreaming = true; continue; }
+		if ( arg == "--unpaced" ) { options->mPaced = false; continue; }
+
+		if ( ! value )
+		{
+			return false;
+		}
+		i++;
+
+		if ( arg == "--seconds" ) options->mSeconds = ::atof( value );
+		else if ( arg == "--runs" ) options->mNumRuns = ::atoi( value );
+		else if ( arg == "--fps" ) options->mFrameRate = float( ::atof( value ) );
+		else if ( arg == "--width" ) options->mWidth = ::atoi( value );
+		else if ( arg == "--height" ) options->mHeight = ::atoi( value );
+		else if ( arg == "--audio-rate" ) options->mAudioSampleRate = ::atoi( value );
+		else if ( arg == "--audio-block" ) options->mAudioBlockSize = std::max( 1, ::atoi( value ) );
+		else if ( arg == "--audio-tracks" ) options->mNumAudioTracks = std::max( 1, ::atoi( value ) );
+		else if ( arg == "--encoder" ) options->mPathEncoder = value;
+		else if ( arg == "--encoder-fps" ) options->mEncoderFps = value;
+		else if ( arg == "--stall-every" ) options->mStallEvery = value;
+		else if ( arg == "--stall-ms" ) options->mStallMs = value;
+		else if ( arg == "--crash-after" ) options->mCrashAfter = value;
+		else if ( arg == "--output" ) options->mPathOutput = value;
+		else return false;
+	}
+	return true;
+}
+
+} // anonymous namespace
+
+int main( int argc, char **argv )
+{
+	Options options;
+	if ( ! parseOptions( argc, argv, &options ) )
+	{
+		std::fprintf( stderr, "usage: %s [--seconds s] [--runs n] [--fps f] [--width w] [--height h] "
+				"[--audio-rate r] [--audio-block n] [--audio-tracks n] [--no-audio] [--no-audio-buffers] "
+				"[--streaming] [--unpaced] "
+				"[--encoder path] [--encoder-fps f] [--stall-every n] [--stall-ms ms] "
+				"[--crash-after n] [--output path]\n", argv[ 0 ] );
+		return 2;
+	}
+	if ( options.mPathEncoder.empty() )
+	{
+		// built next to the harness
+		options.mPathEncoder = fs::absolute( fs::path( argv[ 0 ] ) ).parent_path() / "FakeEncoder";
+	}
+
+	// releasing a writer starts the finisher thread, which lives as long as the process
+	const size_t baseThreads = getNumThreads() + 1;
+	const size_t baseRss = getCurrentRss();
+	bool failed = false;
+
+	std::printf( "run frames dropped repeated skipped duplicates gaps torn partial drift_ms max_add_ms "
+			"shutdown_ms threads_peak threads_left rss_kb rss_peak_kb exit\n" );
+
+	for ( int i = 0; i < options.mNumRuns; i++ )
+	{
+		RunResult result = run( options, i );
+
+		// the finisher deletes the released writer in the background
+		size_t threadsLeft = getNumThreads();
+		for ( int wait = 0; wait < 100 && threadsLeft > baseThreads; wait++ )
+		{
+			std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+			threadsLeft = getNumThreads();
+		}
+		auto encoderValue = [&]( const std::string &key ) {
+			auto it = result.mEncoder.find( key );
+			return it != result.mEncoder.end() ? it->second : std::string( "-" );
+		};
+		const double driftMs = ::atof( encoderValue( "av_drift" ).c_str() ) * 1000.0;
+
+		std::printf( "%d %zu %zu %zu %zu %s %s %s %s %.2f %.2f %.2f %zu %zu %zu %zu %d\n",
+				i, result.mNumFramesSubmitted, result.mNumFramesDropped,
+				result.mNumFramesRepeated, result.mNumFramesSkipped,
+				encoderValue( "video_duplicates" ).c_str(), encoderValue( "video_gaps" ).c_str(),
+				encoderValue( "video_torn" ).c_str(), encoderValue( "video_partial_bytes" ).c_str(),
+				driftMs, result.mMaxAddFrameMs, result.mShutdownMs,
+				result.mPeakThreads, threadsLeft, getCurrentRss(), getPeakRss(),
+				result.mFinalize.mExitStatus );
+		std::fflush( stdout );
+
+		// a crashing encoder leaves no report, repeats show up as duplicates
+		// and skipped or dropped frames as gaps
+		if ( ! result.mEncoder.empty() &&
+			 ( encoderValue( "video_torn" ) != "0" ||
+			   std::stoul( encoderValue( "video_duplicates" ) ) > result.mNumFramesRepeated ||
+			   std::stoul( encoderValue( "video_gaps" ) ) > result.mNumFramesSkipped + result.mNumFramesDropped ) )
+		{
+			failed = true;
+		}
+		if ( ! result.mEncoder.empty() && options.mRecordAudio &&
+			 ( ( options.mAddAudioBuffers ? std::abs( driftMs ) > 1000.0 / options.mFrameRate :
+				 encoderValue( "audio_samples" ) != "0" ) ||
+			   encoderValue( "audio_stream_valid" ) != "1" ||
+			   encoderValue( "audio_timestamp_errors" ) != "0" ||
+			   encoderValue( "audio_tracks" ) != std::to_string( options.mNumAudioTracks ) ) )
+		{
+			failed = true;
+		}
+		if ( threadsLeft > baseThreads )
+		{
+			failed = true;
+		}
+	}
+
+	std::printf( "baseline rss_kb %zu threads %zu\n", baseRss, baseThreads );
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+/*
+ Streams a test pattern over UDP with FFmpegMovieWriter in streaming mode and
+ measures the latency until each frame comes out of a local ffmpeg receiver.
+ Every frame carries its id as a barcode in the top rows, the receiver
+ decodes it and looks up the time the frame was submitted.
+*/
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cinder/Log.h"
+#include "cinder/app/App.h"
+#include "cinder/app/RendererGl.h"
+#include "cinder/gl/gl.h"
+
+#include "FFmpegMovieWriter.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+class StreamingLatencyApp : public App
+{
+ public:
+	static void prepareSettings( Settings *settings );
+
+	void setup() override;
+	void update() override;
+	void draw() override;
+	void cleanup() override;
+
+ private:
+	typedef std::chrono::steady_clock Clock;
+
+	static const int32_t kWidth = 640;
+	static const int32_t kHeight = 360;
+	static const int32_t kNumBits = 24;
+	static const int32_t kBitSize = 24;
+	static const size_t kHistorySize = 1024;
+	static const size_t kNumLatencies = 300;
+
+	const std::string kUrl = "udp://127.0.0.1:12345";
+
+	mndl::FFmpegMovieWriterRef mMovieWriter;
+	uint32_t mFrameId = 0;
+
+	struct SentFrame
+	{
+		uint32_t mId = 0;
+		Clock::time_point mTime;
+	};
+
+	std::array< SentFrame, kHistorySize > mSentFrames;
+	std::vector< double > mLatencies;
+	size_t mNumFramesReceived = 0;
+	std::mutex mMutex;
+
+	void receiverThreadFn();
+	std::shared_ptr< std::thread > mThreadReceiver;
+	std::atomic< bool > mReceiverShouldQuit;
+
+	Surface8uRef createFrame( uint32_t id );
+	uint32_t decodeFrameId( const uint8_t *gray ) const;
+
+	gl::Texture2dRef mTexFrame;
+};
+
+void StreamingLatencyApp::prepareSettings( App::Settings *settings )
+{
+	settings->setWindowSize( ivec2( kWidth, kHeight ) );
+	settings->setFrameRate( 60.0f );
+}
+
+void StreamingLatencyApp::setup()
+{
+	mReceiverShouldQuit = false;
+	mThreadReceiver = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &StreamingLatencyApp::receiverThreadFn, this ) ) );
+
+	auto format = mndl::FFmpegMovieWriter::Format()
+		.streaming()
+		.codecVideo( "libx264" )
+		.bitRateVideo( "4000k" )
+		.frameRate( 60.0f )
+		.videoChannelOrder( SurfaceChannelOrder::RGB );
+
+	mMovieWriter = mndl::FFmpegMovieWriter::create( kUrl + "?pkt_size=1316",
+			kWidth, kHeight, format );
+}
+
+Surface8uRef StreamingLatencyApp::createFrame( uint32_t id )
+{
+	auto surface = Surface8u::create( kWidth, kHeight, false, SurfaceChannelOrder::RGB );
+
+	for ( int32_t y = 0; y < kHeight; y++ )
+	{
+		uint8_t *row = surface->getData() + y * surface->getRowBytes();
+		for ( int32_t x = 0; x < kWidth; x++ )
+		{
+			uint8_t v = uint8_t( ( x + id * 4 ) & 0xff );
+			if ( y < kBitSize )
+			{
+				// barcode, most significant bit first
+				int32_t bit = x / kBitSize;
+				v = ( bit < kNumBits && ( ( id >> ( kNumBits - 1 - bit ) ) & 1 ) ) ? 255 : 0;
+			}
+			row[ x * 3 ] = row[ x * 3 + 1 ] = row[ x * 3 + 2 ] = v;
+		}
+	}
+
+	return surface;
+}
+
+uint32_t StreamingLatencyApp::decodeFrameId( const uint8_t *gray ) const
+{
+	uint32_t id = 0;
+	const uint8_t *row = gray + ( kBitSize / 2 ) * kWidth;
+	for ( int32_t bit = 0; bit < kNumBits; bit++ )
+	{
+		id = ( id << 1 ) | ( row[ bit * kBitSize + kBitSize / 2 ] > 127 ? 1 : 0 );
+	}
+	return id;
+}
+
+void StreamingLatencyApp::receiverThreadFn()
+{
+	// the receiver gives up two seconds after the stream stops
+	std::string cmd = "ffmpeg -loglevel quiet -fflags nobuffer -flags low_delay "
+		"-probesize 32 -analyzeduration 0 -i \"" + kUrl + "?timeout=2000000\" "
+		"-f rawvideo -pix_fmt gray -";
+
+	FILE *pipe = ::popen( cmd.c_str(), "r" );
+	if ( ! pipe )
+	{
+		CI_LOG_E( "Failed to start the receiver: " << cmd );
+		return;
+	}
+
+	std::vector< uint8_t > frame( kWidth * kHeight );
+	while ( ! mReceiverShouldQuit &&
+			::fread( frame.data(), 1, frame.size(), pipe ) == frame.size() )
+	{
+		Clock::time_point now = Clock::now();
+		uint32_t id = decodeFrameId( frame.data() );
+
+		std::lock_guard< std::mutex > lock( mMutex );
+		const SentFrame &sent = mSentFrames[ id % kHistorySize ];
+		if ( sent.mId != id )
+		{
+			continue;
+		}
+
+		double latency = std::chrono::duration< double, std::milli >( now - sent.mTime ).count();
+		mLatencies.push_back( latency );
+		if ( mLatencies.size() > kNumLatencies )
+		{
+			mLatencies.erase( mLatencies.begin() );
+		}
+		mNumFramesReceived++;
+	}
+
+	::pclose( pipe );
+}
+
+void StreamingLatencyApp::update()
+{
+	if ( ! mMovieWriter )
+	{
+		return;
+	}
+
+	auto frame = createFrame( mFrameId );
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		SentFrame &sent = mSentFrames[ mFrameId % kHistorySize ];
+		sent.mId = mFrameId;
+		sent.mTime = Clock::now();
+	}
+	mMovieWriter->addFrame( frame );
+	mFrameId++;
+
+	mTexFrame = gl::Texture2d::create( *frame );
+
+	if ( getElapsedFrames() % 300 == 0 )
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		if ( ! mLatencies.empty() )
+		{
+			auto sorted = mLatencies;
+			std::sort( sorted.begin(), sorted.end() );
+			CI_LOG_I( "latency ms min " << sorted.front() <<
+					" median " << sorted[ sorted.size() / 2 ] <<
+					" p95 " << sorted[ sorted.size() * 95 / 100 ] <<
+					" max " << sorted.back() <<
+					" received " << mNumFramesReceived << "/" << mFrameId <<
+					" dropped " << mMovieWriter->getNumVideoFramesDropped() );
+		}
+	}
+}
+
+void StreamingLatencyApp::draw()
+{
+	gl::clear();
+	if ( mTexFrame )
+	{
+		gl::draw( mTexFrame, getWindowBounds() );
+	}
+
+	std::lock_guard< std::mutex > lock( mMutex );
+	if ( ! mLatencies.empty() )
+	{
+		auto sorted = mLatencies;
+		std::sort( sorted.begin(), sorted.end() );
+		gl::drawString( "median latency " + std::to_string( sorted[ sorted.size() / 2 ] ) +
+				" ms, p95 " + std::to_string( sorted[ sorted.size() * 95 / 100 ] ) + " ms",
+				vec2( 40, 60 ) );
+	}
+}
+
+void StreamingLatencyApp::cleanup()
+{
+	mMovieWriter.reset();
+	mReceiverShouldQuit = true;
+	mThreadReceiver->join();
+}
+
+CINDER_APP( StreamingLatencyApp, RendererGl, StreamingLatencyApp::prepareSettings )
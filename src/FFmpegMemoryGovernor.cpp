@@ -0,0 +1,224 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+
+#include "FFmpegMemoryGovernor.h"
+
+namespace mndl {
+
+FFmpegMemoryGovernor::Client::~Client()
+{
+	mGovernor->removeClient( this );
+}
+
+bool FFmpegMemoryGovernor::Client::acquire( size_t bytes, bool block )
+{
+	FFmpegMemoryGovernor *g = mGovernor;
+	std::unique_lock< std::mutex > lock( g->mMutex );
+	if ( mCanceled )
+	{
+		return false;
+	}
+	if ( g->fits( this, bytes ) )
+	{
+		g->charge( this, bytes );
+		return true;
+	}
+
+	mNumDenied++;
+	if ( ! block )
+	{
+		return false;
+	}
+
+	// only a waiting client holds back the others, an idle one would stall
+	// them for as long as it does not come back
+	const bool starved = mUsage + bytes <= g->mBudget / g->mClients.size();
+	if ( starved )
+	{
+		g->setStarved( this, true );
+	}
+	g->mCondition.wait( lock, [ & ] { return mCanceled || g->fits( this, bytes ); } );
+	if ( starved )
+	{
+		g->setStarved( this, false );
+		// clients above their share may be waiting for this one
+		g->mCondition.notify_all();
+	}
+	if ( mCanceled )
+	{
+		return false;
+	}
+	g->charge( this, bytes );
+	return true;
+}
+
+void FFmpegMemoryGovernor::Client::reserve( size_t bytes )
+{
+	std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+	mReserved += bytes;
+	mGovernor->charge( this, bytes );
+}
+
+void FFmpegMemoryGovernor::Client::release( size_t bytes )
+{
+	{
+		std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+		bytes = std::min( bytes, mUsage - mReserved );
+		mUsage -= bytes;
+		mGovernor->mUsage -= bytes;
+	}
+	mGovernor->mCondition.notify_all();
+}
+
+void FFmpegMemoryGovernor::Client::cancel()
+{
+	{
+		std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+		mCanceled = true;
+	}
+	mGovernor->mCondition.notify_all();
+}
+
+bool FFmpegMemoryGovernor::Client::isCanceled() const
+{
+	std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+	return mCanceled;
+}
+
+size_t FFmpegMemoryGovernor::Client::getUsage() const
+{
+	std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+	return mUsage;
+}
+
+size_t FFmpegMemoryGovernor::Client::getPeakUsage() const
+{
+	std::lock_guard< std::mutex > lock( mGovernor->mMutex );
+	return mPeakUsage;
+}
+
+FFmpegMemoryGovernor & FFmpegMemoryGovernor::get()
+{
+	// never destroyed, writers may still be finishing during static destruction
+	static FFmpegMemoryGovernor *sGovernor = new FFmpegMemoryGovernor();
+	return *sGovernor;
+}
+
+void FFmpegMemoryGovernor::setBudget( size_t bytes )
+{
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mBudget = bytes;
+	}
+	mCondition.notify_all();
+}
+
+size_t FFmpegMemoryGovernor::getBudget() const
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mBudget;
+}
+
+size_t FFmpegMemoryGovernor::getUsage() const
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mUsage;
+}
+
+size_t FFmpegMemoryGovernor::getPeakUsage() const
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	return mPeakUsage;
+}
+
+std::vector< FFmpegMemoryGovernor::Usage > FFmpegMemoryGovernor::getUsages() const
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	std::vector< Usage > usages;
+	for ( const Client *client : mClients )
+	{
+		usages.push_back( { client->mName, client->mUsage, client->mPeakUsage, client->mNumDenied } );
+	}
+	return usages;
+}
+
+FFmpegMemoryGovernor::ClientRef FFmpegMemoryGovernor::addClient( const std::string &name )
+{
+	ClientRef client( new Client( this, name ) );
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mClients.push_back( client.get() );
+	}
+	// the fair shares shrink
+	mCondition.notify_all();
+	return client;
+}
+
+void FFmpegMemoryGovernor::removeClient( Client *client )
+{
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mUsage -= client->mUsage;
+		setStarved( client, false );
+		mClients.erase( std::remove( mClients.begin(), mClients.end(), client ), mClients.end() );
+	}
+	mCondition.notify_all();
+}
+
+void FFmpegMemoryGovernor::charge( Client *client, size_t bytes )
+{
+	client->mUsage += bytes;
+	client->mPeakUsage = std::max( client->mPeakUsage, client->mUsage );
+	mUsage += bytes;
+	mPeakUsage = std::max( mPeakUsage, mUsage );
+}
+
+void FFmpegMemoryGovernor::setStarved( Client *client, bool starved )
+{
+	if ( client->mStarved != starved )
+	{
+		client->mStarved = starved;
+		mNumStarved += starved ? 1 : -1;
+	}
+}
+
+bool FFmpegMemoryGovernor::fits( const Client *client, size_t bytes ) const
+{
+	// reservations do not count, a reservation above the budget would
+	// otherwise block the first allocation forever
+	if ( mBudget == 0 || client->mUsage == client->mReserved )
+	{
+		return true;
+	}
+	if ( mUsage + bytes > mBudget )
+	{
+		return false;
+	}
+	// within the budget, but clients above their share wait for starved ones
+	const size_t share = mBudget / mClients.size();
+	return client->mUsage + bytes <= share || mNumStarved == 0;
+}
+
+}
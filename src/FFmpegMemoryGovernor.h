@@ -0,0 +1,116 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mndl {
+
+//! Process wide byte budget shared by the queued frames and conversion
+//! buffers of all writers. Every writer is a client with a fair share of the
+//! budget, a client above its share has to wait or drop frames while clients
+//! below their share are blocked waiting for memory.
+class FFmpegMemoryGovernor
+{
+ public:
+	class Client
+	{
+	 public:
+		~Client();
+
+		//! Charges \a bytes to the budget. If the budget is exhausted it blocks until enough memory is released when \a block is true, otherwise returns false. A client holding nothing besides its reservations is always allowed one allocation, so a single frame larger than the budget still goes through.
+		bool acquire( size_t bytes, bool block );
+		//! Accounts for memory allocated regardless of the budget, such as conversion buffers.
+		void reserve( size_t bytes );
+		void release( size_t bytes );
+
+		//! Wakes up a blocked acquire(), which then fails, as do later calls.
+		void cancel();
+		bool isCanceled() const;
+
+		size_t getUsage() const;
+		size_t getPeakUsage() const;
+
+	 protected:
+		Client( FFmpegMemoryGovernor *governor, const std::string &name ) :
+			mGovernor( governor ), mName( name ) {}
+
+		FFmpegMemoryGovernor *mGovernor;
+		std::string mName;
+		size_t mUsage = 0;
+		//! Part of mUsage charged by reserve().
+		size_t mReserved = 0;
+		size_t mPeakUsage = 0;
+		size_t mNumDenied = 0;
+		//! Blocked below its fair share, clients above their share wait until it gets memory.
+		bool mStarved = false;
+		bool mCanceled = false;
+
+		friend class FFmpegMemoryGovernor;
+	};
+	typedef std::shared_ptr< Client > ClientRef;
+
+	static FFmpegMemoryGovernor & get();
+
+	//! Budget in bytes, 0 disables the limit but usage is still tracked.
+	void setBudget( size_t bytes );
+	size_t getBudget() const;
+
+	size_t getUsage() const;
+	size_t getPeakUsage() const;
+
+	struct Usage
+	{
+		std::string mName;
+		size_t mUsage;
+		size_t mPeakUsage;
+		//! Allocations that had to wait or were refused.
+		size_t mNumDenied;
+	};
+	std::vector< Usage > getUsages() const;
+
+	ClientRef addClient( const std::string &name );
+
+ protected:
+	FFmpegMemoryGovernor() {}
+
+	void removeClient( Client *client );
+	void charge( Client *client, size_t bytes );
+	void setStarved( Client *client, bool starved );
+	bool fits( const Client *client, size_t bytes ) const;
+
+	mutable std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::vector< Client * > mClients;
+	size_t mBudget = 0;
+	size_t mUsage = 0;
+	size_t mPeakUsage = 0;
+	size_t mNumStarved = 0;
+};
+
+}
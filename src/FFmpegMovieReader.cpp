@@ -0,0 +1,567 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+#include "cinder/Log.h"
+
+#include "FFmpegMovieReader.h"
+#include "FFmpegUtils.h"
+
+using namespace ci;
+
+namespace mndl {
+
+namespace {
+
+const size_t kNoSlot = std::numeric_limits< size_t >::max();
+//! Surfaces the application can hold on to without stalling the decoder.
+const size_t kNumReadSlots = 2;
+const char *kIndexHeader = "FFmpegMovieReader index 1";
+
+//! Starts \a args with their output connected to the returned descriptor.
+int openCommand( const std::vector< std::string > &args, pid_t *pid )
+{
+	int fds[ 2 ];
+	if ( ::pipe( fds ) != 0 )
+	{
+		return -1;
+	}
+	::fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+	::fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+
+	*pid = detail::spawnProcess( args, -1, fds[ 1 ] );
+	::close( fds[ 1 ] );
+	if ( *pid <= 0 )
+	{
+		CI_LOG_E( args[ 0 ] << " command failed - " << ::strerror( errno ) << "." );
+		::close( fds[ 0 ] );
+		return -1;
+	}
+	return fds[ 0 ];
+}
+
+void closeCommand( int fd, pid_t pid )
+{
+	::close( fd );
+	int status;
+	while ( ::waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+	{ }
+}
+
+//! Runs \a args and returns their whole output.
+std::string readCommand( const std::vector< std::string > &args )
+{
+	std::string output;
+	if ( ! detail::runCommand( args, &output ) )
+	{
+		CI_LOG_E( args[ 0 ] << " command failed - " << ::strerror( errno ) << "." );
+	}
+	return output;
+}
+
+bool readFully( int fd, uint8_t *data, size_t size )
+{
+	while ( size > 0 )
+	{
+		ssize_t n = ::read( fd, data, size );
+		if ( n > 0 )
+		{
+			data += n;
+			size -= n;
+		}
+		else
+		if ( n == 0 || errno != EINTR )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool readSurface( int fd, const Surface8uRef &surface )
+{
+	const size_t rowSize = size_t( surface->getWidth() ) * surface->getPixelInc();
+	if ( ptrdiff_t( rowSize ) == surface->getRowBytes() )
+	{
+		return readFully( fd, surface->getData(), rowSize * surface->getHeight() );
+	}
+
+	for ( int32_t y = 0; y < surface->getHeight(); y++ )
+	{
+		if ( ! readFully( fd, surface->getData() + y * surface->getRowBytes(), rowSize ) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//! Parses the key=value lines printed by ffprobe.
+std::string getProbeValue( const std::string &output, const std::string &key )
+{
+	std::istringstream stream( output );
+	std::string line;
+	while ( std::getline( stream, line ) )
+	{
+		if ( line.compare( 0, key.size() + 1, key + "=" ) == 0 )
+		{
+			return line.substr( key.size() + 1 );
+		}
+	}
+	return "";
+}
+
+double parseRational( const std::string &value )
+{
+	int num = 0, den = 0;
+	if ( ::sscanf( value.c_str(), "%d/%d", &num, &den ) == 2 )
+	{
+		return den > 0 ? double( num ) / den : 0.0;
+	}
+	return ::atof( value.c_str() );
+}
+
+bool getFileStamp( const fs::path &path, long long *size, long long *mtime )
+{
+	struct stat info;
+	if ( ::stat( path.string().c_str(), &info ) != 0 )
+	{
+		return false;
+	}
+	*size = info.st_size;
+	*mtime = info.st_mtime;
+	return true;
+}
+
+} // anonymous namespace
+
+FFmpegMovieReader::Format::Format()
+{ }
+
+FFmpegMovieReader::Format::Format( const Format &format ) :
+	mPathFFmpeg( format.mPathFFmpeg ),
+	mPathFFprobe( format.mPathFFprobe ),
+	mChannelOrder( format.mChannelOrder ),
+	mNumPrefetchFrames( format.mNumPrefetchFrames ),
+	mCacheIndex( format.mCacheIndex ),
+	mLoop( format.mLoop )
+{ }
+
+const FFmpegMovieReader::Format & FFmpegMovieReader::Format::operator=( const Format &format )
+{
+	mPathFFmpeg = format.mPathFFmpeg;
+	mPathFFprobe = format.mPathFFprobe;
+	mChannelOrder = format.mChannelOrder;
+	mNumPrefetchFrames = format.mNumPrefetchFrames;
+	mCacheIndex = format.mCacheIndex;
+	mLoop = format.mLoop;
+	return *this;
+}
+
+FFmpegMovieReader::FFmpegMovieReader( const fs::path &path, const Format &format ) :
+	mFormat( format ), mPathMovie( path )
+{
+	mGeneration = 0;
+	mThreadShouldQuit = false;
+	mLoop = mFormat.mLoop;
+	mEndOfMovie = false;
+
+	fs::path indexPath = mPathMovie;
+	indexPath += ".index";
+	if ( ! mFormat.mCacheIndex || ! loadIndex( indexPath ) )
+	{
+		buildIndex();
+		if ( mFormat.mCacheIndex )
+		{
+			saveIndex( indexPath );
+		}
+	}
+
+	SurfaceChannelOrder channelOrder = mFormat.mChannelOrder;
+	if ( channelOrder.getCode() > SurfaceChannelOrder::BGR )
+	{
+		channelOrder = SurfaceChannelOrder( SurfaceChannelOrder::RGB );
+	}
+
+	const size_t numSlots = std::max< size_t >( 1, mFormat.mNumPrefetchFrames ) + kNumReadSlots;
+	mRing = std::make_shared< Ring >( numSlots );
+	for ( size_t i = 0; i < numSlots; i++ )
+	{
+		mRing->mSurfaces.push_back( Surface8u::create( mWidth, mHeight,
+					channelOrder.hasAlpha(), channelOrder ) );
+		mRing->mFreeSlots.pushFront( i );
+	}
+	// never fills up, there are no more frames than slots
+	mFrames.reset( new ConcurrentCircularBuffer< Frame >( numSlots ) );
+	mSkipBuffer.resize( size_t( mRing->mSurfaces[ 0 ]->getRowBytes() ) * mHeight );
+
+	mGeneration = 1;
+	mThreadDecode = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &FFmpegMovieReader::decodeThreadFn, this ) ) );
+}
+
+FFmpegMovieReader::~FFmpegMovieReader()
+{
+	{
+		std::lock_guard< std::mutex > lock( mSeekMutex );
+		mThreadShouldQuit = true;
+	}
+	mSeekCondition.notify_one();
+
+	// surfaces still held by the application no longer return to the ring
+	mRing->mFreeSlots.cancel();
+	mFrames->cancel();
+
+	mThreadDecode->join();
+	mThreadDecode.reset();
+}
+
+bool FFmpegMovieReader::loadIndex( const fs::path &indexPath )
+{
+	long long size, mtime;
+	if ( ! getFileStamp( mPathMovie, &size, &mtime ) )
+	{
+		throw FFmpegMovieReaderExc( "Cannot open " + mPathMovie.string() );
+	}
+
+	std::ifstream file( indexPath.string() );
+	std::string header;
+	if ( ! std::getline( file, header ) || header != kIndexHeader )
+	{
+		return false;
+	}
+
+	long long indexSize, indexMtime;
+	size_t numKeyframes = 0;
+	file >> indexSize >> indexMtime >> mWidth >> mHeight >> mFrameRate >> mNumFrames >> numKeyframes;
+	if ( ! file || indexSize != size || indexMtime != mtime )
+	{
+		// the movie changed since the index was written
+		return false;
+	}
+
+	mKeyframes.resize( numKeyframes );
+	for ( auto &keyframe : mKeyframes )
+	{
+		file >> keyframe.mFrame >> keyframe.mTime;
+	}
+	if ( ! file || mKeyframes.empty() || mWidth <= 0 || mHeight <= 0 || mFrameRate <= 0.0 )
+	{
+		mKeyframes.clear();
+		return false;
+	}
+	return true;
+}
+
+void FFmpegMovieReader::saveIndex( const fs::path &indexPath ) const
+{
+	long long size, mtime;
+	std::ofstream file( indexPath.string() );
+	if ( ! file || ! getFileStamp( mPathMovie, &size, &mtime ) )
+	{
+		CI_LOG_W( "Cannot write index " << indexPath << "." );
+		return;
+	}
+
+	file << kIndexHeader << "\n";
+	file << size << " " << mtime << "\n";
+	file << std::setprecision( std::numeric_limits< double >::max_digits10 );
+	file << mWidth << " " << mHeight << " " << mFrameRate << " " << mNumFrames << "\n";
+	file << mKeyframes.size() << "\n";
+	for ( const auto &keyframe : mKeyframes )
+	{
+		file << keyframe.mFrame << " " << keyframe.mTime << "\n";
+	}
+}
+
+void FFmpegMovieReader::buildIndex()
+{
+	const std::string ffprobe = detail::findExecutable( mFormat.mPathFFprobe );
+	const std::string info = readCommand( { ffprobe, "-v", "error", "-select_streams", "v:0",
+		"-show_entries", "stream=width,height,avg_frame_rate,r_frame_rate:format=start_time",
+		"-of", "default=noprint_wrappers=1", mPathMovie.string() } );
+
+	mWidth = ::atoi( getProbeValue( info, "width" ).c_str() );
+	mHeight = ::atoi( getProbeValue( info, "height" ).c_str() );
+	mFrameRate = parseRational( getProbeValue( info, "avg_frame_rate" ) );
+	if ( mFrameRate <= 0.0 )
+	{
+		mFrameRate = parseRational( getProbeValue( info, "r_frame_rate" ) );
+	}
+	if ( mWidth <= 0 || mHeight <= 0 || mFrameRate <= 0.0 )
+	{
+		throw FFmpegMovieReaderExc( "No video stream in " + mPathMovie.string() );
+	}
+	// input seeking is relative to the start of the container
+	const double startTime = ::atof( getProbeValue( info, "start_time" ).c_str() );
+
+	// the packet list only needs demuxing, so it is fast even for long movies
+	std::istringstream packets( readCommand( { ffprobe, "-v", "error", "-select_streams", "v:0",
+		"-show_entries", "packet=pts_time,flags", "-of", "csv=p=0", mPathMovie.string() } ) );
+
+	// packets are in decoding order, frames are numbered in presentation order
+	std::vector< std::pair< double, bool > > frames;
+	std::string line;
+	while ( std::getline( packets, line ) )
+	{
+		size_t comma = line.find( ',' );
+		if ( comma == std::string::npos || line.compare( 0, 3, "N/A" ) == 0 )
+		{
+			continue;
+		}
+		frames.emplace_back( ::atof( line.c_str() ) - startTime,
+				line.find( 'K', comma ) != std::string::npos );
+	}
+	std::sort( frames.begin(), frames.end() );
+
+	mNumFrames = frames.size();
+	mKeyframes.clear();
+	for ( size_t i = 0; i < frames.size(); i++ )
+	{
+		if ( frames[ i ].second )
+		{
+			mKeyframes.push_back( { i, frames[ i ].first } );
+		}
+	}
+	if ( mKeyframes.empty() || mKeyframes[ 0 ].mFrame != 0 )
+	{
+		mKeyframes.insert( mKeyframes.begin(), { 0, 0.0 } );
+	}
+}
+
+std::vector< size_t > FFmpegMovieReader::getKeyframes() const
+{
+	std::vector< size_t > keyframes;
+	for ( const auto &keyframe : mKeyframes )
+	{
+		keyframes.push_back( keyframe.mFrame );
+	}
+	return keyframes;
+}
+
+const FFmpegMovieReader::Keyframe & FFmpegMovieReader::getKeyframeBefore( size_t frameNumber ) const
+{
+	auto it = std::upper_bound( mKeyframes.begin(), mKeyframes.end(), frameNumber,
+			[]( size_t frame, const Keyframe &keyframe ) { return frame < keyframe.mFrame; } );
+	return *( it - 1 );
+}
+
+Surface8uRef FFmpegMovieReader::readFrame()
+{
+	Frame frame;
+	while ( mFrames->tryPopBack( &frame ) )
+	{
+		if ( frame.mGeneration != mGeneration ||
+			 ( frame.mPass == mSkipPass && frame.mFrameNumber < mSkipUntil ) )
+		{
+			// decoded before a seek
+			mRing->mFreeSlots.pushFront( frame.mSlot );
+			continue;
+		}
+
+		mFrameNumber = frame.mFrameNumber;
+		mNextFrameNumber = mFrameNumber + 1;
+		mPass = frame.mPass;
+
+		// the surface goes back to the ring instead of being deleted
+		std::shared_ptr< Ring > ring = mRing;
+		const size_t slot = frame.mSlot;
+		return Surface8uRef( ring->mSurfaces[ slot ].get(),
+				[ ring, slot ]( Surface8u * ) { ring->mFreeSlots.pushFront( slot ); } );
+	}
+	return nullptr;
+}
+
+bool FFmpegMovieReader::isDone() const
+{
+	return mEndOfMovie && ! mFrames->isNotEmpty();
+}
+
+void FFmpegMovieReader::seekToFrame( size_t frameNumber )
+{
+	if ( mNumFrames > 0 )
+	{
+		frameNumber = std::min( frameNumber, mNumFrames - 1 );
+	}
+
+	// decoding on is cheaper than restarting if the frame is within the
+	// prefetch window or there is no keyframe in between
+	const size_t prefetchEnd = mNextFrameNumber + std::max< size_t >( 1, mFormat.mNumPrefetchFrames );
+	if ( frameNumber >= mNextFrameNumber &&
+		 ( frameNumber < prefetchEnd || getKeyframeBefore( frameNumber ).mFrame <= mNextFrameNumber ) &&
+		 ! isDone() )
+	{
+		mSkipUntil = frameNumber;
+		mSkipPass = mPass;
+		mNextFrameNumber = frameNumber;
+		return;
+	}
+
+	{
+		std::lock_guard< std::mutex > lock( mSeekMutex );
+		mSeekFrame = frameNumber;
+		mEndOfMovie = false;
+		mGeneration++;
+	}
+	mSeekCondition.notify_one();
+
+	// hand the prefetched frames back to the decoder
+	Frame frame;
+	while ( mFrames->tryPopBack( &frame ) )
+	{
+		mRing->mFreeSlots.pushFront( frame.mSlot );
+	}
+
+	mNextFrameNumber = frameNumber;
+	mPass = 0;
+	mSkipUntil = 0;
+	mSkipPass = 0;
+}
+
+void FFmpegMovieReader::seekToTime( double seconds )
+{
+	seekToFrame( size_t( std::max( 0.0, seconds ) * mFrameRate + 0.5 ) );
+}
+
+void FFmpegMovieReader::decodeThreadFn()
+{
+	ThreadSetup threadSetup;
+
+	uint64_t generation = 0;
+	for ( ;; )
+	{
+		size_t startFrame;
+		{
+			std::unique_lock< std::mutex > lock( mSeekMutex );
+			mSeekCondition.wait( lock, [ & ] { return mThreadShouldQuit || mGeneration != generation; } );
+			if ( mThreadShouldQuit )
+			{
+				break;
+			}
+			generation = mGeneration;
+			startFrame = mSeekFrame;
+		}
+
+		size_t pass = 0;
+		while ( decode( startFrame, generation, pass ) )
+		{
+			if ( ! mLoop )
+			{
+				std::lock_guard< std::mutex > lock( mSeekMutex );
+				if ( generation == mGeneration )
+				{
+					mEndOfMovie = true;
+				}
+				break;
+			}
+			startFrame = 0;
+			pass++;
+		}
+	}
+}
+
+bool FFmpegMovieReader::decode( size_t startFrame, uint64_t generation, size_t pass )
+{
+	const Keyframe &keyframe = getKeyframeBefore( startFrame );
+
+	// started without a shell, seeks and loops restart it
+	std::vector< std::string > args = { detail::findExecutable( mFormat.mPathFFmpeg ), "-loglevel", "quiet" };
+	if ( keyframe.mFrame > 0 )
+	{
+		// input seeking goes back to the last keyframe before the time, a
+		// quarter frame after the keyframe is safe from rounding and does not
+		// reach the previous one, the frames from the keyframe on are kept
+		std::stringstream seekTime;
+		seekTime << std::fixed << std::setprecision( 6 ) << keyframe.mTime + 0.25 / mFrameRate;
+		args.insert( args.end(), { "-noaccurate_seek", "-ss", seekTime.str() } );
+	}
+	args.insert( args.end(), { "-i", mPathMovie.string(), "-map", "0:v:0", "-vsync", "passthrough",
+		"-f", "rawvideo", "-pix_fmt", detail::getPixelFormat( mRing->mSurfaces[ 0 ]->getChannelOrder() ),
+		"pipe:1" } );
+
+	pid_t pid;
+	int fd = openCommand( args, &pid );
+	if ( fd < 0 )
+	{
+		return false;
+	}
+
+	bool endOfMovie = false;
+	size_t frameNumber = keyframe.mFrame;
+	while ( ! mThreadShouldQuit && generation == mGeneration )
+	{
+		if ( frameNumber < startFrame )
+		{
+			// frames between the keyframe and the seek target are never queued
+			if ( ! readFully( fd, mSkipBuffer.data(), mSkipBuffer.size() ) )
+			{
+				endOfMovie = true;
+				break;
+			}
+			frameNumber++;
+			continue;
+		}
+
+		// blocks while the ring is full, the queue is canceled on quit
+		size_t slot = kNoSlot;
+		mRing->mFreeSlots.popBack( &slot );
+		if ( slot == kNoSlot )
+		{
+			break;
+		}
+
+		if ( ! readSurface( fd, mRing->mSurfaces[ slot ] ) )
+		{
+			mRing->mFreeSlots.pushFront( slot );
+			endOfMovie = true;
+			break;
+		}
+		mFrames->pushFront( { slot, frameNumber, generation, pass } );
+		frameNumber++;
+	}
+
+	if ( ! endOfMovie )
+	{
+		// a decoder has nothing to clean up, stop it right away
+		::kill( pid, SIGKILL );
+	}
+	closeCommand( fd, pid );
+
+	return endOfMovie && ! mThreadShouldQuit && generation == mGeneration;
+}
+
+}
@@ -0,0 +1,196 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cinder/ConcurrentCircularBuffer.h"
+#include "cinder/Exception.h"
+#include "cinder/Filesystem.h"
+#include "cinder/Surface.h"
+#include "cinder/Thread.h"
+
+namespace mndl {
+
+typedef std::shared_ptr< class FFmpegMovieReader > FFmpegMovieReaderRef;
+
+class FFmpegMovieReaderExc : public ci::Exception
+{
+ public:
+	FFmpegMovieReaderExc( const std::string &description ) : ci::Exception( description ) {}
+};
+
+//! Plays back movies with the command line ffmpeg. Frames are decoded ahead
+//! on a worker thread into a bounded ring of recycled surfaces, seeking is
+//! frame accurate using a keyframe index that is cached next to the movie.
+class FFmpegMovieReader
+{
+ public:
+	class Format
+	{
+	 public:
+		Format();
+		Format( const Format &format );
+
+		const Format & operator=( const Format &format );
+
+		Format & ffmpegPath( const ci::fs::path &path ) { mPathFFmpeg = path; return *this; }
+		ci::fs::path getFFmpegPath() const { return mPathFFmpeg; }
+		void setFFmpegPath( const ci::fs::path &path ) { mPathFFmpeg = path; }
+
+		Format & ffprobePath( const ci::fs::path &path ) { mPathFFprobe = path; return *this; }
+		ci::fs::path getFFprobePath() const { return mPathFFprobe; }
+		void setFFprobePath( const ci::fs::path &path ) { mPathFFprobe = path; }
+
+		//! Channel order of the returned surfaces, the conversion is done by ffmpeg.
+		Format & channelOrder( const ci::SurfaceChannelOrder &channelOrder ) { mChannelOrder = channelOrder; return *this; }
+		ci::SurfaceChannelOrder getChannelOrder() const { return mChannelOrder; }
+		void setChannelOrder( const ci::SurfaceChannelOrder &channelOrder ) { mChannelOrder = channelOrder; }
+
+		//! Number of frames decoded ahead of playback.
+		Format & numPrefetchFrames( size_t numFrames ) { mNumPrefetchFrames = numFrames; return *this; }
+		size_t getNumPrefetchFrames() const { return mNumPrefetchFrames; }
+		void setNumPrefetchFrames( size_t numFrames ) { mNumPrefetchFrames = numFrames; }
+
+		//! Stores the keyframe index next to the movie as <movie>.index, so it is only built on the first open.
+		Format & cacheIndex( bool cacheIndex = true ) { mCacheIndex = cacheIndex; return *this; }
+		bool getCacheIndex() const { return mCacheIndex; }
+		void setCacheIndex( bool cacheIndex = true ) { mCacheIndex = cacheIndex; }
+
+		Format & loop( bool loop = true ) { mLoop = loop; return *this; }
+		bool getLoop() const { return mLoop; }
+		void setLoop( bool loop = true ) { mLoop = loop; }
+
+	private:
+		ci::fs::path mPathFFmpeg = "ffmpeg";
+		ci::fs::path mPathFFprobe = "ffprobe";
+		ci::SurfaceChannelOrder mChannelOrder = ci::SurfaceChannelOrder( ci::SurfaceChannelOrder::RGB );
+		size_t mNumPrefetchFrames = 8;
+		bool mCacheIndex = true;
+		bool mLoop = false;
+
+		friend class FFmpegMovieReader;
+	};
+
+	//! Probes the movie and builds or loads its keyframe index, throws FFmpegMovieReaderExc if the movie has no readable video stream.
+	static FFmpegMovieReaderRef create( const ci::fs::path &path, const Format &format = Format() )
+	{ return FFmpegMovieReaderRef( new FFmpegMovieReader( path, format ) ); }
+
+	~FFmpegMovieReader();
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	float getFrameRate() const { return float( mFrameRate ); }
+	size_t getNumFrames() const { return mNumFrames; }
+	double getDuration() const { return mNumFrames / mFrameRate; }
+	//! Frame numbers of the keyframes in ascending order.
+	std::vector< size_t > getKeyframes() const;
+
+	//! Returns the next decoded frame or nullptr if it is not ready yet, never blocks. The surface goes back to the ring when it is released, holding on to more than a couple of frames stalls decoding.
+	ci::Surface8uRef readFrame();
+	//! Number of the frame last returned by readFrame().
+	size_t getFrameNumber() const { return mFrameNumber; }
+	//! True once the last frame has been read and the movie does not loop.
+	bool isDone() const;
+
+	//! The next frame returned by readFrame() is \a frameNumber. Seeking forward within the prefetched frames or before the next keyframe skips decoded frames instead of restarting the decoder.
+	void seekToFrame( size_t frameNumber );
+	void seekToTime( double seconds );
+
+	void setLoop( bool loop = true ) { mLoop = loop; }
+	bool getLoop() const { return mLoop; }
+
+ protected:
+	FFmpegMovieReader( const ci::fs::path &path, const Format &format );
+
+	const Format mFormat;
+	ci::fs::path mPathMovie;
+
+	int32_t mWidth = 0;
+	int32_t mHeight = 0;
+	double mFrameRate = 0.0;
+	size_t mNumFrames = 0;
+
+	struct Keyframe
+	{
+		size_t mFrame;
+		//! Seconds from the start of the movie.
+		double mTime;
+	};
+	std::vector< Keyframe > mKeyframes;
+
+	bool loadIndex( const ci::fs::path &indexPath );
+	void saveIndex( const ci::fs::path &indexPath ) const;
+	void buildIndex();
+	const Keyframe & getKeyframeBefore( size_t frameNumber ) const;
+
+	struct Frame
+	{
+		size_t mSlot;
+		size_t mFrameNumber;
+		uint64_t mGeneration;
+		//! Incremented every time a looping movie starts over.
+		size_t mPass;
+	};
+
+	//! Surfaces shared with the frames handed out, which return their slot when released.
+	struct Ring
+	{
+		Ring( size_t numSlots ) : mFreeSlots( numSlots ) {}
+
+		std::vector< ci::Surface8uRef > mSurfaces;
+		ci::ConcurrentCircularBuffer< size_t > mFreeSlots;
+	};
+	std::shared_ptr< Ring > mRing;
+	std::unique_ptr< ci::ConcurrentCircularBuffer< Frame > > mFrames;
+
+	void decodeThreadFn();
+	//! Returns true at the end of the movie, false if a seek or quit interrupted decoding.
+	bool decode( size_t startFrame, uint64_t generation, size_t pass );
+	std::shared_ptr< std::thread > mThreadDecode;
+	std::vector< uint8_t > mSkipBuffer;
+
+	std::mutex mSeekMutex;
+	std::condition_variable mSeekCondition;
+	size_t mSeekFrame = 0;
+	std::atomic< uint64_t > mGeneration;
+	std::atomic< bool > mThreadShouldQuit;
+	std::atomic< bool > mLoop;
+	std::atomic< bool > mEndOfMovie;
+
+	size_t mFrameNumber = 0;
+	size_t mNextFrameNumber = 0;
+	size_t mPass = 0;
+	//! Frames of mSkipPass before mSkipUntil are dropped by readFrame().
+	size_t mSkipUntil = 0;
+	size_t mSkipPass = 0;
+};
+
+}
@@ -23,8 +23,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
 #include <sstream>
 
 #include "cinder/Log.h"
@@ -32,285 +45,2289 @@
 #include "cinder/app/App.h"
 
 #include "FFmpegMovieWriter.h"
+#include "FFmpegUtils.h"
 
 using namespace ci;
 
 namespace mndl {
 
-int32_t FFmpegMovieWriter::sPipeId = 0;
+namespace {
 
-FFmpegMovieWriter::Format::Format()
-{ }
+const size_t kVideoQueueSize = 10;
+const size_t kAudioQueueSize = 20;
+// a couple of frames and ~50ms of audio at 44.1kHz with 512 frame buffers
+const size_t kStreamingVideoQueueSize = 2;
+const size_t kStreamingAudioQueueSize = 4;
 
-FFmpegMovieWriter::Format::Format( const Format &format ) :
-	mPathFFmpeg( format.mPathFFmpeg ),
-	mCodecVideo( format.mCodecVideo ),
-	mCodecAudio( format.mCodecAudio ),
-	mBitRateVideo( format.mBitRateVideo ),
-	mBitRateAudio( format.mBitRateAudio ),
-	mFrameRate( format.mFrameRate ),
-	mAudioSampleRate( format.mAudioSampleRate ),
-	mNumAudioInputChannels( format.mNumAudioInputChannels ),
-	mVideoChannelOrder( format.mVideoChannelOrder ),
-	mRecordVideo( format.mRecordVideo ),
-	mRecordAudio( format.mRecordAudio ),
-	mVerbose( format.mVerbose )
-{ }
+// matroska elements of the audio stream, the ids include their length marker
+const uint32_t kEbmlHeader = 0x1A45DFA3;
+const uint32_t kEbmlVersion = 0x4286;
+const uint32_t kEbmlReadVersion = 0x42F7;
+const uint32_t kEbmlMaxIdLength = 0x42F2;
+const uint32_t kEbmlMaxSizeLength = 0x42F3;
+const uint32_t kEbmlDocType = 0x4282;
+const uint32_t kEbmlDocTypeVersion = 0x4287;
+const uint32_t kEbmlDocTypeReadVersion = 0x4285;
+const uint32_t kMkvSegment = 0x18538067;
+const uint32_t kMkvInfo = 0x1549A966;
+const uint32_t kMkvTimestampScale = 0x2AD7B1;
+const uint32_t kMkvMuxingApp = 0x4D80;
+const uint32_t kMkvWritingApp = 0x5741;
+const uint32_t kMkvTracks = 0x1654AE6B;
+const uint32_t kMkvTrackEntry = 0xAE;
+const uint32_t kMkvTrackNumber = 0xD7;
+const uint32_t kMkvTrackUid = 0x73C5;
+const uint32_t kMkvTrackType = 0x83;
+const uint32_t kMkvFlagLacing = 0x9C;
+const uint32_t kMkvCodecId = 0x86;
+const uint32_t kMkvAudio = 0xE1;
+const uint32_t kMkvSamplingFrequency = 0xB5;
+const uint32_t kMkvChannels = 0x9F;
+const uint32_t kMkvBitDepth = 0x6264;
+const uint32_t kMkvCluster = 0x1F43B675;
+const uint32_t kMkvClusterTimestamp = 0xE7;
+const uint32_t kMkvSimpleBlock = 0xA3;
+// sizes are always written with 8 bytes, all ones marks a live element
+const uint64_t kEbmlUnknownSize = 0x00FFFFFFFFFFFFFFull;
+// track numbers are written as single byte varints in the block headers
+const size_t kMaxAudioTracks = 126;
+// block timestamps are 16-bit offsets from the cluster timestamp
+const uint64_t kAudioClusterDuration = 1000;
+// samples per channel in a block of silence written for a dropped buffer
+const size_t kAudioSilenceFrames = 1024;
+// threads packing high bit depth frames
+const unsigned kMaxPackThreads = 8;
+// cluster id, size and timestamp followed by the block id, size, track,
+// timestamp and flags
+const size_t kAudioBlockHeaderSize = 4 + 8 + 1 + 8 + 8 + 1 + 8 + 4;
 
-const FFmpegMovieWriter::Format & FFmpegMovieWriter::Format::operator=( const Format &format )
+// Branch and table free log2 and exp2 approximations, accurate to about 2e-7,
+// so the transfer function loops vectorize. Clamps and selects are written as
+// arithmetic too, compilers keep float compares as branches by default.
+const float kMinPositive = 1e-30f;
+
+//! \a v is a positive normal number.
+inline float fastLog2( float v )
 {
-	mPathFFmpeg = format.mPathFFmpeg;
-	mCodecVideo = format.mCodecVideo;
-	mCodecAudio = format.mCodecAudio;
-	mBitRateVideo = format.mBitRateVideo;
-	mBitRateAudio = format.mBitRateAudio;
-	mFrameRate = format.mFrameRate;
-	mAudioSampleRate = format.mAudioSampleRate;
-	mNumAudioInputChannels = format.mNumAudioInputChannels;
-	mVideoChannelOrder = format.mVideoChannelOrder;
-	mRecordVideo = format.mRecordVideo;
-	mRecordAudio = format.mRecordAudio;
-	mVerbose = format.mVerbose;
-	return *this;
+	int32_t bits;
+	std::memcpy( &bits, &v, sizeof( bits ) );
+	const float exponent = float( ( bits >> 23 ) - 127 );
+	bits = ( bits & 0x007fffff ) | 0x3f800000;
+	float mantissa;
+	std::memcpy( &mantissa, &bits, sizeof( mantissa ) );
+
+	// log2 of the mantissa in [1, 2)
+	const float u = mantissa - 1.0f;
+	float p = -0.00866569951f;
+	p = p * u + 0.0494333692f;
+	p = p * u - 0.133146927f;
+	p = p * u + 0.238041982f;
+	p = p * u - 0.345429331f;
+	p = p * u + 0.478176445f;
+	p = p * u - 0.721095741f;
+	p = p * u + 1.44268584f;
+	p = p * u + 5.64224401e-08f;
+	return exponent + p;
 }
 
-FFmpegMovieWriter::FFmpegMovieWriter( const ci::fs::path &path,
-		int32_t width, int32_t height, const Format &format ) :
-	mFormat( format ),
-	mPathMovie( path ),
-	mMovieWidth( width ), mMovieHeight( height )
+//! \a v is in [-126, 127).
+inline float fastExp2( float v )
 {
-	setupFFmpeg();
+	// biased by the float exponent bias, the integer part is the exponent
+	const float biased = v + 127.0f;
+	const int32_t exponent = int32_t( biased );
+	const float f = biased - float( exponent );
+
+	// 2^f for f in [0, 1)
+	float p = 0.000218657849f;
+	p = p * f + 0.00123913318f;
+	p = p * f + 0.00968418643f;
+	p = p * f + 0.0554806292f;
+	p = p * f + 0.240230456f;
+	p = p * f + 0.693146944f;
+	p = p * f + 1.0f;
+
+	const int32_t bits = exponent << 23;
+	float scale;
+	std::memcpy( &scale, &bits, sizeof( scale ) );
+	return p * scale;
 }
 
-FFmpegMovieWriter::~FFmpegMovieWriter()
+//! \a v is in [0, 1], \a e in (0, 1] or applied to a base close to 1.
+inline float fastPow( float v, float e )
 {
-	if ( mFormat.mRecordVideo )
+	return fastExp2( e * fastLog2( v + kMinPositive ) );
+}
+
+inline float positive( float v )
+{
+	return 0.5f * ( v + std::abs( v ) );
+}
+
+inline float select( bool condition, float a, float b )
+{
+	return b + ( condition ? 1.0f : 0.0f ) * ( a - b );
+}
+
+inline float clamp01( float v )
+{
+	v = positive( v );
+	return select( v > 1.0f, 1.0f, v );
+}
+
+// Transfer functions of linear light in [0, 1], both sides of the piecewise
+// curves are evaluated.
+struct TransferLinear
+{
+	float operator()( float v ) const { return clamp01( v ); }
+};
+
+struct TransferSrgb
+{
+	float operator()( float v ) const
 	{
-		cleanupVideoThread();
+		v = clamp01( v );
+		return select( v <= 0.0031308f, 12.92f * v, 1.055f * fastPow( v, 1.0f / 2.4f ) - 0.055f );
 	}
-	if ( mFormat.mRecordAudio )
+};
+
+struct TransferBt709
+{
+	float operator()( float v ) const
 	{
-		cleanupAudioThread();
+		v = clamp01( v );
+		return select( v < 0.018f, 4.5f * v, 1.099f * fastPow( v, 0.45f ) - 0.099f );
+	}
+};
+
+struct TransferPq
+{
+	// SMPTE ST 2084, 1.0 is 10000 cd/m2
+	float operator()( float v ) const
+	{
+		const float m1 = 2610.0f / 16384.0f;
+		const float m2 = 2523.0f / 4096.0f * 128.0f;
+		const float c1 = 3424.0f / 4096.0f;
+		const float c2 = 2413.0f / 4096.0f * 32.0f;
+		const float c3 = 2392.0f / 4096.0f * 32.0f;
+		const float p = fastPow( clamp01( v ), m1 );
+		return clamp01( fastPow( ( c1 + c2 * p ) / ( 1.0f + c3 * p ), m2 ) );
+	}
+};
+
+struct TransferHlg
+{
+	// ARIB STD-B67
+	float operator()( float v ) const
+	{
+		const float a = 0.17883277f;
+		const float b = 0.28466892f;
+		const float c = 0.55991073f;
+		const float ln2 = 0.693147181f;
+		v = clamp01( v );
+		const float curve = a * ln2 * fastLog2( positive( 12.0f * v - b ) + kMinPositive ) + c;
+		return select( v <= 1.0f / 12.0f, fastPow( 3.0f * v, 0.5f ), curve );
+	}
+};
+
+template< typename Transfer >
+void applyTransferFunction( float *row, int32_t count )
+{
+	const Transfer transfer;
+	for ( int32_t x = 0; x < count; x++ )
+	{
+		row[ x ] = transfer( row[ x ] );
 	}
-	cleanupFFmpeg();
 }
 
-void FFmpegMovieWriter::setupFFmpeg()
+void applyTransferFunction( FFmpegMovieWriter::Format::TransferFunction transferFunction,
+		float *row, int32_t count )
 {
-	mThreadFFmpegInitialized = false;
-	mNumAudioSamplesRecorded = 0;
-	mNumVideoFramesRecorded = 0;
+	switch ( transferFunction )
+	{
+		case FFmpegMovieWriter::Format::TRANSFER_SRGB:
+			applyTransferFunction< TransferSrgb >( row, count );
+			break;
 
-	mThreadFFmpeg = std::shared_ptr< std::thread >( new std::thread(
-				std::bind( &FFmpegMovieWriter::ffmpegThreadFn, this ) ) );
+		case FFmpegMovieWriter::Format::TRANSFER_BT709:
+			applyTransferFunction< TransferBt709 >( row, count );
+			break;
+
+		case FFmpegMovieWriter::Format::TRANSFER_PQ:
+			applyTransferFunction< TransferPq >( row, count );
+			break;
+
+		case FFmpegMovieWriter::Format::TRANSFER_HLG:
+			applyTransferFunction< TransferHlg >( row, count );
+			break;
+
+		default:
+			applyTransferFunction< TransferLinear >( row, count );
+			break;
+	}
 }
 
-void FFmpegMovieWriter::ffmpegThreadFn()
+// Linear Rec.709 to BT.2020 primaries, ITU-R BT.2087
+void convertRec709ToBt2020( float *r, float *g, float *b, int32_t width )
 {
-	std::stringstream outputSettings;
-	if ( mFormat.mRecordVideo )
+	for ( int32_t x = 0; x < width; x++ )
 	{
-		outputSettings << " -vcodec " << mFormat.mCodecVideo <<
-			" -b:v " << mFormat.mBitRateVideo;
+		const float r709 = r[ x ];
+		const float g709 = g[ x ];
+		const float b709 = b[ x ];
+		r[ x ] = 0.6274f * r709 + 0.3293f * g709 + 0.0433f * b709;
+		g[ x ] = 0.0691f * r709 + 0.9195f * g709 + 0.0114f * b709;
+		b[ x ] = 0.0164f * r709 + 0.0880f * g709 + 0.8956f * b709;
 	}
-	if ( mFormat.mRecordAudio )
+}
+
+// Splits a row into PixelInc planar float rows of \a width, scaled to [0, 1].
+// The fixed stride loop vectorizes, the color offsets only pick the rows.
+template< typename T, int PixelInc >
+void unpackRow( const T *src, int32_t width, float scale, float *channels )
+{
+	for ( int32_t c = 0; c < PixelInc; c++ )
 	{
-		outputSettings << " -c:a " << mFormat.mCodecAudio <<
-			" -b:a " << mFormat.mBitRateAudio;
+		float *channel = channels + c * width;
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			channel[ x ] = float( src[ x * PixelInc + c ] ) * scale;
+		}
 	}
-	outputSettings << " \"" << mPathMovie.string() << "\"";
+}
 
-	if ( mFormat.mRecordVideo )
+template< typename T >
+void unpackRow( const uint8_t *src, int32_t width, uint8_t pixelInc, float scale, float *channels )
+{
+	const T *row = reinterpret_cast< const T * >( src );
+	if ( pixelInc == 4 )
 	{
-		mPipeVideo = app::getAppPath() / ( "pipevideo" + std::to_string( sPipeId ) );
-		if ( ! fs::exists( mPipeVideo ) )
+		unpackRow< T, 4 >( row, width, scale, channels );
+	}
+	else
+	{
+		unpackRow< T, 3 >( row, width, scale, channels );
+	}
+}
+
+inline uint16_t toComponent16( float v )
+{
+	return uint16_t( v * 65535.0f + 0.5f );
+}
+
+// Averages the 2x2 blocks of two rows, an odd last column is paired with itself.
+void downsampleRows( const float *row0, const float *row1, int32_t width, float *dst )
+{
+	const int32_t numPairs = width / 2;
+	for ( int32_t x = 0; x < numPairs; x++ )
+	{
+		dst[ x ] = ( row0[ x * 2 ] + row0[ x * 2 + 1 ] + row1[ x * 2 ] + row1[ x * 2 + 1 ] ) * 0.25f;
+	}
+	if ( width & 1 )
+	{
+		dst[ numPairs ] = ( row0[ width - 1 ] + row1[ width - 1 ] ) * 0.5f;
+	}
+}
+
+// Writes 10-bit limited range u and v samples every Stride words, shifted to
+// the high bits for p010.
+template< int Stride >
+void packChromaRow( const float *r, const float *g, const float *b, int32_t width,
+		float kr, float kb, int shift, uint16_t *u, uint16_t *v )
+{
+	const float kg = 1.0f - kr - kb;
+	const float uScale = 896.0f / ( 2.0f * ( 1.0f - kb ) );
+	const float vScale = 896.0f / ( 2.0f * ( 1.0f - kr ) );
+	for ( int32_t x = 0; x < width; x++ )
+	{
+		const float l = kr * r[ x ] + kg * g[ x ] + kb * b[ x ];
+		u[ x * Stride ] = uint16_t( uint16_t( 512.0f + ( b[ x ] - l ) * uScale + 0.5f ) << shift );
+		v[ x * Stride ] = uint16_t( uint16_t( 512.0f + ( r[ x ] - l ) * vScale + 0.5f ) << shift );
+	}
+}
+
+// Filters ffmpeg at \a ffmpegPath was built with, listed once per path. Empty
+// if ffmpeg could not be run.
+std::set< std::string > getAvailableFilters( const fs::path &ffmpegPath )
+{
+	static std::mutex sMutex;
+	static std::map< std::string, std::set< std::string > > sFilters;
+
+	std::lock_guard< std::mutex > lock( sMutex );
+	auto it = sFilters.find( ffmpegPath.string() );
+	if ( it != sFilters.end() )
+	{
+		return it->second;
+	}
+
+	std::set< std::string > &filters = sFilters[ ffmpegPath.string() ];
+	std::string output;
+	if ( ! detail::runCommand( { detail::findExecutable( ffmpegPath ), "-hide_banner", "-filters" }, &output ) )
+	{
+		return filters;
+	}
+
+	// " T.C drawtext          V->V       Draw text on top of video frames..."
+	std::istringstream lines( output );
+	std::string line;
+	while ( std::getline( lines, line ) )
+	{
+		std::istringstream fields( line );
+		std::string flags, name, io;
+		if ( fields >> flags >> name >> io && io.find( "->" ) != std::string::npos )
 		{
-			mkfifo( mPipeVideo.string().c_str(), 0666 );
+			filters.insert( name );
 		}
 	}
-	if ( mFormat.mRecordAudio )
+	return filters;
+}
+
+bool endsWith( const std::string &str, const std::string &suffix )
+{
+	return str.size() >= suffix.size() &&
+		str.compare( str.size() - suffix.size(), suffix.size(), suffix ) == 0;
+}
+
+// Options that keep \a codec from buffering frames, every encoder has its
+// own, or none like vaapi.
+std::string getLowLatencyOptions( const std::string &codec )
+{
+	if ( codec == "libx264" || codec == "libx265" )
 	{
-		mPipeAudio = app::getAppPath() / ( "pipeaudio" + std::to_string( sPipeId ) );
-		if ( ! fs::exists( mPipeAudio ) )
+		return " -preset ultrafast -tune zerolatency";
+	}
+	else
+	if ( endsWith( codec, "_nvenc" ) )
+	{
+		return " -zerolatency 1";
+	}
+	else
+	if ( endsWith( codec, "_videotoolbox" ) )
+	{
+		return " -realtime 1";
+	}
+	return "";
+}
+
+std::string getFilterName( FFmpegMovieWriter::Filter::Type type )
+{
+	switch ( type )
+	{
+		case FFmpegMovieWriter::Filter::TYPE_TIMECODE:
+			return "drawtext";
+
+		case FFmpegMovieWriter::Filter::TYPE_OVERLAY:
+			return "overlay";
+
+		case FFmpegMovieWriter::Filter::TYPE_PAD:
+			return "pad";
+
+		case FFmpegMovieWriter::Filter::TYPE_SCALE:
+			return "scale";
+
+		default:
+			return "fps";
+	}
+}
+
+// Filter position expression, negative values are measured from the far edge.
+std::string getFilterPosition( int32_t position, const std::string &farEdge )
+{
+	return position >= 0 ? std::to_string( position ) : farEdge + std::to_string( position );
+}
+
+const size_t kTsPacketSize = 188;
+
+// Offset of the payload in an MPEG-TS packet, or 0 if it has none.
+size_t getTsPayloadOffset( const uint8_t *packet )
+{
+	const int adaptationFieldControl = ( packet[ 3 ] >> 4 ) & 3;
+	if ( ! ( adaptationFieldControl & 1 ) )
+	{
+		return 0;
+	}
+	size_t offset = 4;
+	if ( adaptationFieldControl & 2 )
+	{
+		offset += 1 + packet[ 4 ];
+	}
+	return offset < kTsPacketSize ? offset : 0;
+}
+
+// ffmpeg sets the random access indicator on the packets starting a keyframe.
+bool isTsRandomAccess( const uint8_t *packet )
+{
+	const int adaptationFieldControl = ( packet[ 3 ] >> 4 ) & 3;
+	return ( adaptationFieldControl & 2 ) && packet[ 4 ] > 0 && ( packet[ 5 ] & 0x40 );
+}
+
+// Start and end of the PSI section starting in \a packet.
+bool getTsSection( const uint8_t *packet, uint8_t tableId, const uint8_t **begin,
+		const uint8_t **end )
+{
+	size_t offset = getTsPayloadOffset( packet );
+	if ( offset == 0 || ! ( packet[ 1 ] & 0x40 ) )
+	{
+		return false;
+	}
+	offset += 1 + packet[ offset ]; // pointer field
+	if ( offset + 3 > kTsPacketSize || packet[ offset ] != tableId )
+	{
+		return false;
+	}
+
+	const size_t sectionLength = ( ( packet[ offset + 1 ] & 0x0f ) << 8 ) | packet[ offset + 2 ];
+	*begin = packet + offset;
+	// the section ends with a 4 byte crc
+	*end = packet + std::min( offset + 3 + sectionLength - 4, kTsPacketSize );
+	return true;
+}
+
+int parseTsPmtPid( const uint8_t *packet )
+{
+	const uint8_t *begin, *end;
+	if ( ! getTsSection( packet, 0x00, &begin, &end ) )
+	{
+		return -1;
+	}
+	for ( const uint8_t *program = begin + 8; program + 4 <= end; program += 4 )
+	{
+		int programNumber = ( program[ 0 ] << 8 ) | program[ 1 ];
+		if ( programNumber != 0 )
 		{
-			mkfifo( mPipeAudio.string().c_str(), 0666 );
+			return ( ( program[ 2 ] & 0x1f ) << 8 ) | program[ 3 ];
 		}
 	}
-	sPipeId++;
+	return -1;
+}
 
-	std::stringstream cmd;
-		cmd << "bash --login -c '" << mFormat.mPathFFmpeg <<
-		( mFormat.mVerbose ? "" : " -loglevel quiet " ) << "-y";
-	if ( mFormat.mRecordAudio )
+int parseTsVideoPid( const uint8_t *packet )
+{
+	const uint8_t *begin, *end;
+	if ( ! getTsSection( packet, 0x02, &begin, &end ) || begin + 12 > end )
 	{
-		cmd << " -c:a pcm_f32le -f f32le -ar " << mFormat.mAudioSampleRate <<
-			" -ac " << mFormat.mNumAudioInputChannels << " -i \"" <<
-			mPipeAudio.string() << "\"";
+		return -1;
+	}
+	const size_t programInfoLength = ( ( begin[ 10 ] & 0x0f ) << 8 ) | begin[ 11 ];
+	for ( const uint8_t *stream = begin + 12 + programInfoLength; stream + 5 <= end; )
+	{
+		const uint8_t streamType = stream[ 0 ];
+		// mpeg-1/2, mpeg-4 part 2, h.264, hevc
+		if ( streamType == 0x01 || streamType == 0x02 || streamType == 0x10 ||
+			 streamType == 0x1b || streamType == 0x24 )
+		{
+			return ( ( stream[ 1 ] & 0x1f ) << 8 ) | stream[ 2 ];
+		}
+		stream += 5 + ( ( ( stream[ 3 ] & 0x0f ) << 8 ) | stream[ 4 ] );
+	}
+	return -1;
+}
+
+size_t putEbmlId( uint8_t *dst, uint32_t id )
+{
+	const size_t size = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+	for ( size_t i = 0; i < size; i++ )
+	{
+		dst[ i ] = uint8_t( id >> ( ( size - 1 - i ) * 8 ) );
+	}
+	return size;
+}
+
+size_t putEbmlSize( uint8_t *dst, uint64_t size )
+{
+	dst[ 0 ] = 0x01;
+	for ( size_t i = 1; i < 8; i++ )
+	{
+		dst[ i ] = uint8_t( size >> ( ( 7 - i ) * 8 ) );
+	}
+	return 8;
+}
+
+size_t putBigEndian( uint8_t *dst, uint64_t value, size_t size )
+{
+	for ( size_t i = 0; i < size; i++ )
+	{
+		dst[ i ] = uint8_t( value >> ( ( size - 1 - i ) * 8 ) );
+	}
+	return size;
+}
+
+void appendEbmlElement( std::vector< uint8_t > *dst, uint32_t id, const uint8_t *data, size_t size )
+{
+	uint8_t header[ 12 ];
+	size_t headerSize = putEbmlId( header, id );
+	headerSize += putEbmlSize( header + headerSize, size );
+	dst->insert( dst->end(), header, header + headerSize );
+	dst->insert( dst->end(), data, data + size );
+}
+
+void appendEbmlElement( std::vector< uint8_t > *dst, uint32_t id, const std::vector< uint8_t > &children )
+{
+	appendEbmlElement( dst, id, children.data(), children.size() );
+}
+
+void appendEbmlUInt( std::vector< uint8_t > *dst, uint32_t id, uint64_t value )
+{
+	uint8_t data[ 8 ];
+	appendEbmlElement( dst, id, data, putBigEndian( data, value, 8 ) );
+}
+
+void appendEbmlFloat( std::vector< uint8_t > *dst, uint32_t id, double value )
+{
+	uint64_t bits;
+	std::memcpy( &bits, &value, sizeof( bits ) );
+	appendEbmlUInt( dst, id, bits );
+}
+
+void appendEbmlString( std::vector< uint8_t > *dst, uint32_t id, const std::string &value )
+{
+	appendEbmlElement( dst, id, reinterpret_cast< const uint8_t * >( value.data() ), value.size() );
+}
+
+// Blocks SIGPIPE on the writer thread, so a write to a pipe ffmpeg has
+// closed fails with EPIPE instead of killing the app. The disposition of the
+// host application is left alone, a SIGPIPE raised by our writes is consumed
+// before the mask is restored.
+class SigpipeBlocker
+{
+ public:
+	SigpipeBlocker()
+	{
+		sigemptyset( &mSigpipe );
+		sigaddset( &mSigpipe, SIGPIPE );
+		::pthread_sigmask( SIG_BLOCK, &mSigpipe, &mPreviousMask );
+	}
+
+	~SigpipeBlocker()
+	{
+		sigset_t pending;
+		sigpending( &pending );
+		if ( sigismember( &pending, SIGPIPE ) && ! sigismember( &mPreviousMask, SIGPIPE ) )
+		{
+			int signal;
+			sigwait( &mSigpipe, &signal );
+		}
+		::pthread_sigmask( SIG_SETMASK, &mPreviousMask, nullptr );
+	}
+
+ private:
+	sigset_t mSigpipe;
+	sigset_t mPreviousMask;
+};
+
+// EPIPE is expected once ffmpeg exits, its exit status is logged when it is
+// reaped
+void logWriteError( int serrno )
+{
+	if ( serrno == EPIPE )
+	{
+		CI_LOG_W( "ffmpeg closed the pipe, writing stops." );
 	}
 	else
 	{
-		cmd << " -an";
+		CI_LOG_E( "Write to pipe failed with error -> " << serrno
+				<< " - " << ::strerror( serrno ) << "." );
+	}
+}
+
+bool writeFully( int fd, const uint8_t *data, size_t size )
+{
+	while ( size > 0 )
+	{
+		ssize_t written = ::write( fd, data, size );
+		if ( written < 0 )
+		{
+			if ( errno == EINTR )
+			{
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= written;
 	}
+	return true;
+}
+
+//! Writes every buffer of \a iov, which is modified on partial writes.
+bool writeFully( int fd, iovec *iov, int count )
+{
+	while ( count > 0 )
+	{
+		ssize_t written = ::writev( fd, iov, count );
+		if ( written < 0 )
+		{
+			if ( errno == EINTR )
+			{
+				continue;
+			}
+			return false;
+		}
+		while ( count > 0 && size_t( written ) >= iov->iov_len )
+		{
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if ( count > 0 )
+		{
+			iov->iov_base = static_cast< uint8_t * >( iov->iov_base ) + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+// Drains and deletes writers released by their last reference on a
+// background thread. Pending writers are finished before the process exits.
+class Finisher
+{
+ public:
+	static Finisher & get()
+	{
+		static Finisher sFinisher;
+		return sFinisher;
+	}
+
+	~Finisher()
+	{
+		{
+			std::lock_guard< std::mutex > lock( mMutex );
+			mShouldQuit = true;
+		}
+		mCondition.notify_one();
+		mThread.join();
+	}
+
+	void add( FFmpegMovieWriter *writer )
+	{
+		writer->finalize();
+
+		std::lock_guard< std::mutex > lock( mMutex );
+		mWriters.push_back( writer );
+		mCondition.notify_one();
+	}
+
+ private:
+	Finisher() :
+		mThread( std::bind( &Finisher::threadFn, this ) )
+	{ }
+
+	void threadFn()
+	{
+		std::unique_lock< std::mutex > lock( mMutex );
+		for ( ;; )
+		{
+			mCondition.wait( lock, [ this ] { return mShouldQuit || ! mWriters.empty(); } );
+			if ( mWriters.empty() )
+			{
+				break;
+			}
+
+			FFmpegMovieWriter *writer = mWriters.front();
+			mWriters.pop_front();
+			lock.unlock();
+			delete writer;
+			lock.lock();
+		}
+	}
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque< FFmpegMovieWriter * > mWriters;
+	bool mShouldQuit = false;
+	std::thread mThread;
+};
+
+} // anonymous namespace
+
+int32_t FFmpegMovieWriter::sPipeId = 0;
+
+FFmpegMovieWriter::Filter FFmpegMovieWriter::Filter::timecode( const ivec2 &position,
+		int32_t fontSize, const fs::path &fontPath )
+{
+	Filter filter( TYPE_TIMECODE );
+	filter.mPosition = position;
+	filter.mFontSize = fontSize;
+	filter.mPath = fontPath;
+	return filter;
+}
+
+FFmpegMovieWriter::Filter FFmpegMovieWriter::Filter::overlay( const fs::path &imagePath,
+		const ivec2 &position )
+{
+	Filter filter( TYPE_OVERLAY );
+	filter.mPath = imagePath;
+	filter.mPosition = position;
+	return filter;
+}
+
+FFmpegMovieWriter::Filter FFmpegMovieWriter::Filter::pad( const ivec2 &size, const Color8u &color )
+{
+	Filter filter( TYPE_PAD );
+	filter.mSize = size;
+	filter.mColor = color;
+	return filter;
+}
+
+FFmpegMovieWriter::Filter FFmpegMovieWriter::Filter::scale( const ivec2 &size )
+{
+	Filter filter( TYPE_SCALE );
+	filter.mSize = size;
+	return filter;
+}
+
+FFmpegMovieWriter::Filter FFmpegMovieWriter::Filter::fps( float frameRate )
+{
+	Filter filter( TYPE_FPS );
+	filter.mFrameRate = frameRate;
+	return filter;
+}
+
+FFmpegMovieWriter::Format::Format()
+{ }
+
+FFmpegMovieWriter::Format::Format( const Format &format ) :
+	mPathFFmpeg( format.mPathFFmpeg ),
+	mCodecVideo( format.mCodecVideo ),
+	mCodecAudio( format.mCodecAudio ),
+	mBitRateVideo( format.mBitRateVideo ),
+	mBitRateAudio( format.mBitRateAudio ),
+	mFrameRate( format.mFrameRate ),
+	mAudioSampleRate( format.mAudioSampleRate ),
+	mNumAudioInputChannels( format.mNumAudioInputChannels ),
+	mAudioTracks( format.mAudioTracks ),
+	mVideoChannelOrder( format.mVideoChannelOrder ),
+	mVideoPixelFormat( format.mVideoPixelFormat ),
+	mVideoTransferFunction( format.mVideoTransferFunction ),
+	mRecordVideo( format.mRecordVideo ),
+	mRecordAudio( format.mRecordAudio ),
+	mVerbose( format.mVerbose ),
+	mStreaming( format.mStreaming ),
+	mStreamingFormat( format.mStreamingFormat ),
+	mSegmented( format.mSegmented ),
+	mMemoryPolicy( format.mMemoryPolicy ),
+	mFilters( format.mFilters ),
+	mTracePath( format.mTracePath )
+{ }
+
+const FFmpegMovieWriter::Format & FFmpegMovieWriter::Format::operator=( const Format &format )
+{
+	mPathFFmpeg = format.mPathFFmpeg;
+	mCodecVideo = format.mCodecVideo;
+	mCodecAudio = format.mCodecAudio;
+	mBitRateVideo = format.mBitRateVideo;
+	mBitRateAudio = format.mBitRateAudio;
+	mFrameRate = format.mFrameRate;
+	mAudioSampleRate = format.mAudioSampleRate;
+	mNumAudioInputChannels = format.mNumAudioInputChannels;
+	mAudioTracks = format.mAudioTracks;
+	mVideoChannelOrder = format.mVideoChannelOrder;
+	mVideoPixelFormat = format.mVideoPixelFormat;
+	mVideoTransferFunction = format.mVideoTransferFunction;
+	mRecordVideo = format.mRecordVideo;
+	mRecordAudio = format.mRecordAudio;
+	mVerbose = format.mVerbose;
+	mStreaming = format.mStreaming;
+	mStreamingFormat = format.mStreamingFormat;
+	mSegmented = format.mSegmented;
+	mMemoryPolicy = format.mMemoryPolicy;
+	mFilters = format.mFilters;
+	mTracePath = format.mTracePath;
+	return *this;
+}
+
+FFmpegMovieWriter::FFmpegMovieWriter( const ci::fs::path &path,
+		int32_t width, int32_t height, const Format &format ) :
+	mFormat( format ),
+	mPathMovie( path ),
+	mMovieWidth( width ), mMovieHeight( height )
+{
+	// throws before any thread or process is started
+	buildFilterGraph();
+	buildAudioTracks();
+
+	if ( ! mFormat.mTracePath.empty() )
+	{
+		mTracer = FFmpegTracer::create();
+	}
+	mMemory = FFmpegMemoryGovernor::get().addClient( mPathMovie.string() );
+	setupFFmpeg();
+}
+
+FFmpegMovieWriterRef FFmpegMovieWriter::create( const ci::fs::path &path,
+		int32_t width, int32_t height, const Format &format )
+{
+	// releasing the last reference hands the writer to the finisher, which
+	// drains and deletes it without blocking the releasing thread
+	return FFmpegMovieWriterRef( new FFmpegMovieWriter( path, width, height, format ),
+			[]( FFmpegMovieWriter *writer ) { Finisher::get().add( writer ); } );
+}
+
+FFmpegMovieWriter::~FFmpegMovieWriter()
+{
+	finalize().wait();
+	mThreadFinalize->join();
+	mThreadFinalize.reset();
+
+	delete mVideoFrames;
+	mVideoFrames = nullptr;
+	delete mAudioFrames;
+	mAudioFrames = nullptr;
+	if ( mAudioFramePool )
+	{
+		AudioFrame *frame = nullptr;
+		while ( mAudioFramePool->tryPopBack( &frame ) )
+		{
+			delete frame;
+		}
+	}
+	delete mAudioFramePool;
+	mAudioFramePool = nullptr;
+}
+
+std::shared_future< FFmpegMovieWriter::FinalizeResult > FFmpegMovieWriter::finalize()
+{
+	std::lock_guard< std::mutex > lock( mFinalizeMutex );
+	if ( ! mThreadFinalize )
+	{
+		mFinalizing = true;
+		// a frame waiting for the memory budget is dropped
+		mMemory->cancel();
+		mFinalizeResult = mFinalizePromise.get_future().share();
+		mThreadFinalize = std::shared_ptr< std::thread >( new std::thread(
+					std::bind( &FFmpegMovieWriter::finalizeThreadFn, this ) ) );
+	}
+	return mFinalizeResult;
+}
+
+void FFmpegMovieWriter::finalizeThreadFn()
+{
+	ThreadSetup threadSetup;
+
+	// both end markers are queued before either thread is joined, ffmpeg may
+	// wait for the end of one input before it opens the other, and a thread
+	// waiting for its pipe does not drain its queue
+	bool videoQueued = ! mFormat.mRecordVideo;
+	bool audioQueued = ! mFormat.mRecordAudio;
+	while ( ! videoQueued || ! audioQueued )
+	{
+		videoQueued = videoQueued || mVideoFrames->tryPushFront( VideoFrame() );
+		audioQueued = audioQueued || mAudioFrames->tryPushFront( nullptr );
+		if ( ! videoQueued || ! audioQueued )
+		{
+			ci::sleep( 1 );
+		}
+	}
+
+	if ( mFormat.mRecordVideo )
+	{
+		cleanupVideoThread();
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		cleanupAudioThread();
+	}
+	cleanupFFmpeg();
+
+	if ( mTracer )
+	{
+		mTracer->write( mFormat.mTracePath );
+	}
+
+	FinalizeResult result;
+	result.mNumVideoFramesWritten = mNumVideoFramesWritten;
+	for ( const auto &track : mAudioTracks )
+	{
+		result.mNumAudioTrackSamplesWritten.push_back( track.mNumSamplesWritten );
+	}
+	if ( ! mAudioTracks.empty() )
+	{
+		result.mNumAudioSamplesWritten = mAudioTracks[ 0 ].mNumSamplesWritten;
+	}
+	result.mNumVideoFramesEncoded = mNumVideoFramesEncoded;
+	result.mExitStatus = mFFmpegExitStatus;
+
+	std::error_code ec;
+	if ( fs::is_regular_file( mPathMovie, ec ) )
+	{
+		result.mFileSize = fs::file_size( mPathMovie, ec );
+	}
+
+	CI_LOG_I( mPathMovie << " finalized, " << result.mNumVideoFramesWritten <<
+			" video frames, " << result.mNumAudioSamplesWritten << " audio samples, " <<
+			result.mFileSize << " bytes." );
+	mFinalizePromise.set_value( result );
+}
+
+void FFmpegMovieWriter::setupFFmpeg()
+{
+	mThreadFFmpegInitialized = false;
+	mFinalizing = false;
+	mPaused = false;
+	mRotatePending = false;
+	mFFmpegExited = false;
+	mFFmpegExitStatus = -1;
+	mNumVideoFramesWritten = 0;
+	mNumVideoFramesRecorded = 0;
+	mNumVideoFramesSubmitted = 0;
+	mNumVideoFramesDropped = 0;
+	mNumVideoFramesEncoded = 0;
+	mVideoIdsWritten.clear();
+	mNumAudioFramesDropped = 0;
+	mNumAudioFramesSubmitted = 0;
+	mNumVideoFramesRepeated = 0;
+	mNumVideoFramesSkipped = 0;
+
+	// the pipes and writer threads are ready before ffmpeg starts, so frames
+	// added while the encoder spins up are queued instead of dropped
+	if ( mFormat.mRecordVideo )
+	{
+		mPipeVideo = app::getAppPath() / ( "pipevideo" + std::to_string( sPipeId ) );
+		if ( ! fs::exists( mPipeVideo ) )
+		{
+			mkfifo( mPipeVideo.string().c_str(), 0666 );
+		}
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		mPipeAudio = app::getAppPath() / ( "pipeaudio" + std::to_string( sPipeId ) );
+		if ( ! fs::exists( mPipeAudio ) )
+		{
+			mkfifo( mPipeAudio.string().c_str(), 0666 );
+		}
+	}
+	if ( ( mTracer || ! mFilterGraph.empty() ) && mFormat.mRecordVideo )
+	{
+		// encoder progress reports give the frame count encoded so far
+		mPipeProgress = app::getAppPath() / ( "pipeprogress" + std::to_string( sPipeId ) );
+		if ( ! fs::exists( mPipeProgress ) )
+		{
+			mkfifo( mPipeProgress.string().c_str(), 0666 );
+		}
+	}
+	sPipeId++;
+
+	if ( isSegmented() )
+	{
+		int fds[ 2 ];
+		if ( ::pipe( fds ) == 0 )
+		{
+			::fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+			::fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+			mSegmentPipe = fds[ 0 ];
+			mSegmentPipeEncoder = fds[ 1 ];
+			setupSegmentThread();
+		}
+	}
+	if ( ! mPipeProgress.empty() )
+	{
+		setupProgressThread();
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		setupAudioThread();
+	}
+	if ( mFormat.mRecordVideo )
+	{
+		setupVideoThread();
+	}
+	mThreadFFmpegInitialized = true;
+
+	mThreadFFmpeg = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &FFmpegMovieWriter::ffmpegThreadFn, this ) ) );
+}
+
+void FFmpegMovieWriter::ffmpegThreadFn()
+{
+	std::stringstream outputSettings;
+	if ( mFormat.mRecordVideo )
+	{
+		outputSettings << " -vcodec " << mFormat.mCodecVideo <<
+			" -b:v " << mFormat.mBitRateVideo;
+
+		if ( mFormat.mVideoPixelFormat != Format::PIXEL_FORMAT_AUTO )
+		{
+			// packVideoRows() converts PQ and HLG frames to BT.2020 primaries
+			const bool wideGamut = mFormat.mVideoTransferFunction == Format::TRANSFER_PQ ||
+				mFormat.mVideoTransferFunction == Format::TRANSFER_HLG;
+			outputSettings << ( wideGamut ? " -colorspace bt2020nc -color_primaries bt2020" :
+					" -colorspace bt709 -color_primaries bt709" );
+
+			switch ( mFormat.mVideoTransferFunction )
+			{
+				case Format::TRANSFER_SRGB:
+					outputSettings << " -color_trc iec61966-2-1";
+					break;
+
+				case Format::TRANSFER_BT709:
+					outputSettings << " -color_trc bt709";
+					break;
+
+				case Format::TRANSFER_PQ:
+					outputSettings << " -color_trc smpte2084";
+					break;
+
+				case Format::TRANSFER_HLG:
+					outputSettings << " -color_trc arib-std-b67";
+					break;
+
+				default:
+					outputSettings << " -color_trc linear";
+					break;
+			}
+		}
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		outputSettings << " -c:a " << mFormat.mCodecAudio <<
+			" -b:a " << mFormat.mBitRateAudio;
+	}
+	if ( mFormat.mStreaming )
+	{
+		if ( mFormat.mRecordVideo )
+		{
+			// no b-frames and a keyframe every second so receivers can join quickly
+			outputSettings << " -bf 0 -g " << std::max( 1, int( mOutputFrameRate + 0.5f ) );
+			outputSettings << getLowLatencyOptions( mFormat.mCodecVideo );
+		}
+		outputSettings << " -flush_packets 1 -max_delay 0 -muxdelay 0 -muxpreload 0 -f " <<
+			mFormat.mStreamingFormat;
+	}
+
+	if ( isSegmented() )
+	{
+		// the segment thread remuxes the transport stream into the movie
+		// files, a keyframe every second bounds the rotation delay
+		if ( mFormat.mRecordVideo )
+		{
+			outputSettings << " -g " << std::max( 1, int( mOutputFrameRate + 0.5f ) );
+		}
+		outputSettings << " -f mpegts pipe:1";
+	}
+	else
+	{
+		outputSettings << " \"" << mPathMovie.string() << "\"";
+	}
+
+	std::stringstream cmd;
+	cmd << "exec " << mFormat.mPathFFmpeg <<
+		( mFormat.mVerbose ? " " : " -loglevel quiet " ) << "-y";
+	if ( ! mPipeProgress.empty() )
+	{
+		// reported every 0.5 seconds by default
+		cmd << " -progress \"" << mPipeProgress.string() << "\" -stats_period 0.1";
+	}
+
+	// raw inputs need no probing, skipping it removes the startup buffering
+	const std::string inputSettings = mFormat.mStreaming ?
+		" -fflags nobuffer -probesize 32 -analyzeduration 0" : "";
+	if ( mFormat.mRecordAudio )
+	{
+		// every track arrives as a pcm stream of a single live matroska input
+		cmd << inputSettings << " -f matroska -i \"" << mPipeAudio.string() << "\"";
+	}
+	else
+	{
+		cmd << " -an";
+	}
+
+	if ( mFormat.mRecordVideo )
+	{
+		std::string pixelFormat = detail::getPixelFormat( mFormat.mVideoChannelOrder );
+
+		switch ( mFormat.mVideoPixelFormat )
+		{
+			// packed on the video thread in native little endian byte order
+			case Format::PIXEL_FORMAT_RGB48:
+				pixelFormat = "rgb48le";
+				break;
+
+			case Format::PIXEL_FORMAT_GBRP16:
+				pixelFormat = "gbrp16le";
+				break;
+
+			case Format::PIXEL_FORMAT_YUV420P10:
+				pixelFormat = "yuv420p10le";
+				break;
+
+			case Format::PIXEL_FORMAT_P010:
+				pixelFormat = "p010le";
+				break;
+
+			default:
+				break;
+		}
+
+		cmd << inputSettings << " -r "<< mFormat.mFrameRate <<
+			" -s " << mMovieWidth << "x" << mMovieHeight <<
+			" -f rawvideo -pix_fmt " << pixelFormat <<
+			" -i \"" << mPipeVideo.string() << "\"";
+
+		if ( ! mFilterGraph.empty() )
+		{
+			// overlay images follow the raw inputs
+			for ( const auto &input : mFilterInputs )
+			{
+				cmd << " -i \"" << input.string() << "\"";
+			}
+			cmd << " -filter_complex \"" << mFilterGraph << "\" -map \"[vout]\"";
+		}
+		else
+		if ( mFormat.mRecordAudio )
+		{
+			cmd << " -map 1:v";
+		}
+		cmd << " -r " << mOutputFrameRate;
+	}
+	else
+	{
+		cmd << " -vn";
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		// ffmpeg only picks a single audio stream unless mapped explicitly
+		cmd << " -map 0:a";
+	}
+	cmd << " " + outputSettings.str();
+	std::string command = cmd.str();
+
+	mFFmpegPid = detail::spawnShellCommand( command, -1, mSegmentPipeEncoder );
+	int serrno = errno;
+	if ( mSegmentPipeEncoder >= 0 )
+	{
+		// only ffmpeg keeps the write end, the segment thread sees the end of
+		// the stream when it exits
+		::close( mSegmentPipeEncoder );
+		mSegmentPipeEncoder = -1;
+	}
+
+	if ( mFFmpegPid > 0 )
+	{
+		CI_LOG_I( command << " command started." );
+	}
+	else
+	{
+		CI_LOG_E( command << " command failed - " << ::strerror( serrno ) << "." );
+		mThreadFFmpegInitialized = false;
+		mFFmpegExited = true;
+		// TODO: throw
+		return;
+	}
+
+	// the thread stays around to reap ffmpeg, which exits once both pipes
+	// are closed and the container is written
+	int status = 0;
+	while ( ::waitpid( mFFmpegPid, &status, 0 ) < 0 && errno == EINTR )
+	{ }
+	mFFmpegExitStatus = WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+	mFFmpegExited = true;
+
+	if ( mFFmpegExitStatus != 0 )
+	{
+		CI_LOG_E( "ffmpeg exited with status " << mFFmpegExitStatus << "." );
+	}
+}
+
+void FFmpegMovieWriter::cleanupFFmpeg()
+{
+	// returns when ffmpeg has exited
+	mThreadFFmpeg->join();
+	mThreadFFmpeg.reset();
+
+	if ( mThreadSegment )
+	{
+		cleanupSegmentThread();
+	}
+
+	if ( mThreadProgress )
+	{
+		cleanupProgressThread();
+	}
+	if ( ! mPipeProgress.empty() )
+	{
+		fs::remove( mPipeProgress );
+	}
+
+	if ( mFormat.mRecordVideo )
+	{
+		fs::remove( mPipeVideo );
+	}
+	if ( mFormat.mRecordAudio )
+	{
+		fs::remove( mPipeAudio );
+	}
+}
+
+void FFmpegMovieWriter::buildFilterGraph()
+{
+	mOutputSize = ivec2( mMovieWidth, mMovieHeight );
+	mOutputFrameRate = mFormat.mFrameRate;
+	if ( mFormat.mFilters.empty() )
+	{
+		return;
+	}
+	if ( ! mFormat.mRecordVideo )
+	{
+		throw FFmpegMovieWriterExc( "Video filters require recording video" );
+	}
+
+	// the audio pipe is input 0 when recording audio, overlay images follow
+	// the video pipe
+	int32_t numInputs = mFormat.mRecordAudio ? 2 : 1;
+	std::string input = "[" + std::to_string( numInputs - 1 ) + ":v]";
+	std::stringstream graph;
+
+	for ( size_t i = 0; i < mFormat.mFilters.size(); i++ )
+	{
+		const Filter &filter = mFormat.mFilters[ i ];
+		const std::string output = i + 1 < mFormat.mFilters.size() ?
+			"[f" + std::to_string( i ) + "]" : "[vout]";
+
+		graph << ( i > 0 ? ";" : "" ) << input;
+		switch ( filter.mType )
+		{
+			case Filter::TYPE_TIMECODE:
+				if ( ! filter.mPath.empty() && ! fs::exists( filter.mPath ) )
+				{
+					throw FFmpegMovieWriterExc( "Timecode font " + filter.mPath.string() + " not found" );
+				}
+				if ( filter.mFontSize <= 0 )
+				{
+					throw FFmpegMovieWriterExc( "Timecode font size must be positive" );
+				}
+				graph << "drawtext=timecode='00\\:00\\:00\\:00':rate=" << mOutputFrameRate <<
+					":fontsize=" << filter.mFontSize << ":fontcolor=white:box=1:boxcolor=black@0.5" <<
+					":x=" << getFilterPosition( filter.mPosition.x, "w-tw" ) <<
+					":y=" << getFilterPosition( filter.mPosition.y, "h-th" );
+				if ( ! filter.mPath.empty() )
+				{
+					graph << ":fontfile='" << filter.mPath.string() << "'";
+				}
+				break;
+
+			case Filter::TYPE_OVERLAY:
+				if ( ! fs::exists( filter.mPath ) )
+				{
+					throw FFmpegMovieWriterExc( "Overlay image " + filter.mPath.string() + " not found" );
+				}
+				mFilterInputs.push_back( filter.mPath );
+				graph << "[" << numInputs++ << ":v]overlay=x=" <<
+					getFilterPosition( filter.mPosition.x, "W-w" ) << ":y=" <<
+					getFilterPosition( filter.mPosition.y, "H-h" );
+				break;
+
+			case Filter::TYPE_PAD:
+				if ( filter.mSize.x < mOutputSize.x || filter.mSize.y < mOutputSize.y )
+				{
+					throw FFmpegMovieWriterExc( "Pad size " + std::to_string( filter.mSize.x ) + "x" +
+							std::to_string( filter.mSize.y ) + " is smaller than the frame size " +
+							std::to_string( mOutputSize.x ) + "x" + std::to_string( mOutputSize.y ) );
+				}
+				{
+					char color[ 16 ];
+					std::snprintf( color, sizeof( color ), "0x%02X%02X%02X",
+							filter.mColor.r, filter.mColor.g, filter.mColor.b );
+					graph << "pad=" << filter.mSize.x << ":" << filter.mSize.y <<
+						":(ow-iw)/2:(oh-ih)/2:color=" << color;
+				}
+				mOutputSize = filter.mSize;
+				break;
+
+			case Filter::TYPE_SCALE:
+			{
+				ivec2 size = filter.mSize;
+				if ( size.x == 0 || size.y == 0 || size.x < -1 || size.y < -1 ||
+					 ( size.x == -1 && size.y == -1 ) )
+				{
+					throw FFmpegMovieWriterExc( "Invalid scale size " + std::to_string( size.x ) +
+							"x" + std::to_string( size.y ) );
+				}
+				// like ffmpeg's -2, yuv 4:2:0 encoders need even sizes
+				if ( size.x == -1 )
+				{
+					size.x = std::max( 2, 2 * int32_t( std::lround(
+									double( size.y ) * mOutputSize.x / mOutputSize.y / 2.0 ) ) );
+				}
+				if ( size.y == -1 )
+				{
+					size.y = std::max( 2, 2 * int32_t( std::lround(
+									double( size.x ) * mOutputSize.y / mOutputSize.x / 2.0 ) ) );
+				}
+				graph << "scale=" << size.x << ":" << size.y;
+				mOutputSize = size;
+				break;
+			}
+
+			case Filter::TYPE_FPS:
+				if ( filter.mFrameRate <= 0.0f )
+				{
+					throw FFmpegMovieWriterExc( "Filter frame rate must be positive" );
+				}
+				graph << "fps=" << filter.mFrameRate;
+				mOutputFrameRate = filter.mFrameRate;
+				break;
+		}
+		graph << output;
+		input = output;
+	}
+
+	// with -loglevel quiet a graph ffmpeg cannot build fails without a word
+	const std::set< std::string > availableFilters = getAvailableFilters( mFormat.mPathFFmpeg );
+	if ( availableFilters.empty() )
+	{
+		CI_LOG_W( "Could not list the filters of " << mFormat.mPathFFmpeg << ", the filter chain is not checked" );
+	}
+	else
+	{
+		for ( const auto &filter : mFormat.mFilters )
+		{
+			const std::string name = getFilterName( filter.mType );
+			if ( ! availableFilters.count( name ) )
+			{
+				throw FFmpegMovieWriterExc( mFormat.mPathFFmpeg.string() + " is built without the " +
+						name + " filter" );
+			}
+		}
+	}
+
+	mFilterGraph = graph.str();
+	CI_LOG_I( "Filter graph " << mFilterGraph << ", output " << mOutputSize.x << "x" <<
+			mOutputSize.y << " at " << mOutputFrameRate << " fps." );
+}
+
+void FFmpegMovieWriter::buildAudioTracks()
+{
+	if ( ! mFormat.mRecordAudio )
+	{
+		return;
+	}
+
+	std::vector< AudioTrack > tracks = mFormat.mAudioTracks;
+	if ( tracks.empty() )
+	{
+		tracks.push_back( AudioTrack( mFormat.mAudioSampleRate, mFormat.mNumAudioInputChannels ) );
+	}
+	if ( tracks.size() > kMaxAudioTracks )
+	{
+		throw FFmpegMovieWriterExc( "At most " + std::to_string( kMaxAudioTracks ) + " audio tracks are supported" );
+	}
+
+	mAudioTracks = std::vector< AudioTrackState >( tracks.size() );
+	std::vector< uint8_t > trackEntries;
+	for ( size_t i = 0; i < tracks.size(); i++ )
+	{
+		if ( tracks[ i ].mSampleRate == 0 || tracks[ i ].mNumChannels == 0 )
+		{
+			throw FFmpegMovieWriterExc( "Audio track " + std::to_string( i ) +
+					" needs a sample rate and at least one channel" );
+		}
+		AudioTrackState &track = mAudioTracks[ i ];
+		track.mSampleRate = tracks[ i ].mSampleRate;
+		track.mNumChannels = tracks[ i ].mNumChannels;
+		track.mStartTime = AudioTrackState::kNotStarted;
+		track.mNumSamplesRecorded = 0;
+		track.mNumSamplesWritten = 0;
+
+		std::vector< uint8_t > audio;
+		appendEbmlFloat( &audio, kMkvSamplingFrequency, double( track.mSampleRate ) );
+		appendEbmlUInt( &audio, kMkvChannels, track.mNumChannels );
+		appendEbmlUInt( &audio, kMkvBitDepth, 32 );
+
+		std::vector< uint8_t > entry;
+		appendEbmlUInt( &entry, kMkvTrackNumber, i + 1 );
+		appendEbmlUInt( &entry, kMkvTrackUid, i + 1 );
+		appendEbmlUInt( &entry, kMkvTrackType, 2 );
+		appendEbmlUInt( &entry, kMkvFlagLacing, 0 );
+		appendEbmlString( &entry, kMkvCodecId, "A_PCM/FLOAT/IEEE" );
+		appendEbmlElement( &entry, kMkvAudio, audio );
+		appendEbmlElement( &trackEntries, kMkvTrackEntry, entry );
+	}
+
+	std::vector< uint8_t > ebml;
+	appendEbmlUInt( &ebml, kEbmlVersion, 1 );
+	appendEbmlUInt( &ebml, kEbmlReadVersion, 1 );
+	appendEbmlUInt( &ebml, kEbmlMaxIdLength, 4 );
+	appendEbmlUInt( &ebml, kEbmlMaxSizeLength, 8 );
+	appendEbmlString( &ebml, kEbmlDocType, "matroska" );
+	appendEbmlUInt( &ebml, kEbmlDocTypeVersion, 4 );
+	appendEbmlUInt( &ebml, kEbmlDocTypeReadVersion, 2 );
+
+	// timestamps are in milliseconds
+	std::vector< uint8_t > info;
+	appendEbmlUInt( &info, kMkvTimestampScale, 1000000 );
+	appendEbmlString( &info, kMkvMuxingApp, "FFmpegMovieWriter" );
+	appendEbmlString( &info, kMkvWritingApp, "FFmpegMovieWriter" );
+
+	mAudioStreamHeader.clear();
+	appendEbmlElement( &mAudioStreamHeader, kEbmlHeader, ebml );
+	// the segment is live, its size is unknown and the clusters follow the tracks
+	uint8_t segment[ 12 ];
+	size_t segmentSize = putEbmlId( segment, kMkvSegment );
+	segmentSize += putEbmlSize( segment + segmentSize, kEbmlUnknownSize );
+	mAudioStreamHeader.insert( mAudioStreamHeader.end(), segment, segment + segmentSize );
+	appendEbmlElement( &mAudioStreamHeader, kMkvInfo, info );
+	appendEbmlElement( &mAudioStreamHeader, kMkvTracks, trackEntries );
+
+	// ffmpeg reads the header up to the first cluster before it opens the
+	// next input, an empty one lets it open the video pipe even if no audio
+	// buffer arrives
+	uint8_t cluster[ 4 + 8 + 1 + 8 + 8 ];
+	size_t clusterSize = putEbmlId( cluster, kMkvCluster );
+	clusterSize += putEbmlSize( cluster + clusterSize, kEbmlUnknownSize );
+	clusterSize += putEbmlId( cluster + clusterSize, kMkvClusterTimestamp );
+	clusterSize += putEbmlSize( cluster + clusterSize, 8 );
+	clusterSize += putBigEndian( cluster + clusterSize, 0, 8 );
+	mAudioStreamHeader.insert( mAudioStreamHeader.end(), cluster, cluster + clusterSize );
+}
+
+bool FFmpegMovieWriter::isSegmented() const
+{
+	return mFormat.mSegmented && ! mFormat.mStreaming;
+}
+
+void FFmpegMovieWriter::pause()
+{
+	mPaused = true;
+}
+
+void FFmpegMovieWriter::resume()
+{
+	mPaused = false;
+}
+
+void FFmpegMovieWriter::rotate( const ci::fs::path &path )
+{
+	if ( ! isSegmented() )
+	{
+		CI_LOG_W( "rotate() requires a segmented format." );
+		return;
+	}
+
+	std::lock_guard< std::mutex > lock( mRotateMutex );
+	mRotatePath = path;
+	mRotatePending = true;
+}
+
+pid_t FFmpegMovieWriter::spawnRemuxer( const ci::fs::path &path, int *fd )
+{
+	int fds[ 2 ];
+	if ( ::pipe( fds ) != 0 )
+	{
+		return -1;
+	}
+	::fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+	::fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+
+	std::stringstream cmd;
+	cmd << "exec " << mFormat.mPathFFmpeg <<
+		( mFormat.mVerbose ? " " : " -loglevel quiet " ) <<
+		"-y -f mpegts -i pipe:0 -map 0 -c copy \"" << path.string() << "\"";
+
+	pid_t pid = detail::spawnShellCommand( cmd.str(), fds[ 0 ] );
+	::close( fds[ 0 ] );
+	if ( pid <= 0 )
+	{
+		CI_LOG_E( cmd.str() << " command failed - " << ::strerror( errno ) << "." );
+		::close( fds[ 1 ] );
+		return -1;
+	}
+
+	*fd = fds[ 1 ];
+	return pid;
+}
+
+void FFmpegMovieWriter::setupSegmentThread()
+{
+	mThreadSegment = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &FFmpegMovieWriter::segmentThreadFn, this ) ) );
+}
+
+void FFmpegMovieWriter::cleanupSegmentThread()
+{
+	mThreadSegment->join();
+	mThreadSegment.reset();
+	::close( mSegmentPipe );
+	mSegmentPipe = -1;
+}
+
+void FFmpegMovieWriter::segmentThreadFn()
+{
+	ThreadSetup threadSetup;
+	SigpipeBlocker sigpipeBlocker;
+
+	int remuxerFd = -1;
+	std::vector< pid_t > remuxerPids;
+	remuxerPids.push_back( spawnRemuxer( mPathMovie, &remuxerFd ) );
+
+	// the latest tables are repeated at the start of every new segment
+	std::vector< uint8_t > pat, pmt;
+	int pmtPid = -1;
+	int videoPid = -1;
+
+	std::vector< uint8_t > buffer( kTsPacketSize * 256 );
+	size_t numBuffered = 0;
+
+	for ( ;; )
+	{
+		ssize_t numRead = ::read( mSegmentPipe, buffer.data() + numBuffered,
+				buffer.size() - numBuffered );
+		if ( numRead < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		if ( numRead <= 0 )
+		{
+			break;
+		}
+		numBuffered += numRead;
+
+		const size_t numPackets = numBuffered / kTsPacketSize;
+		size_t flushed = 0;
+		for ( size_t i = 0; i < numPackets; i++ )
+		{
+			const uint8_t *packet = buffer.data() + i * kTsPacketSize;
+			if ( packet[ 0 ] != 0x47 )
+			{
+				continue;
+			}
+
+			const int pid = ( ( packet[ 1 ] & 0x1f ) << 8 ) | packet[ 2 ];
+			const bool payloadStart = packet[ 1 ] & 0x40;
+
+			if ( pid == 0 && payloadStart )
+			{
+				pat.assign( packet, packet + kTsPacketSize );
+				pmtPid = parseTsPmtPid( packet );
+			}
+			else
+			if ( pid == pmtPid && payloadStart )
+			{
+				pmt.assign( packet, packet + kTsPacketSize );
+				videoPid = parseTsVideoPid( packet );
+			}
+			else
+			if ( mRotatePending && payloadStart && isTsRandomAccess( packet ) &&
+				 ( pid == videoPid || ( videoPid < 0 && ! mFormat.mRecordVideo ) ) )
+			{
+				// cut before the keyframe, everything up to here belongs to
+				// the current file
+				const uint8_t *data = buffer.data() + flushed * kTsPacketSize;
+				if ( remuxerFd >= 0 )
+				{
+					writeFully( remuxerFd, data, ( i - flushed ) * kTsPacketSize );
+					::close( remuxerFd );
+					remuxerFd = -1;
+				}
+				flushed = i;
+
+				std::lock_guard< std::mutex > lock( mRotateMutex );
+				mPathMovie = mRotatePath;
+				mRotatePending = false;
+				remuxerPids.push_back( spawnRemuxer( mPathMovie, &remuxerFd ) );
+				if ( remuxerFd >= 0 )
+				{
+					writeFully( remuxerFd, pat.data(), pat.size() );
+					writeFully( remuxerFd, pmt.data(), pmt.size() );
+				}
+				CI_LOG_I( "Rotated to " << mPathMovie << "." );
+			}
+		}
+
+		if ( remuxerFd >= 0 &&
+			 ! writeFully( remuxerFd, buffer.data() + flushed * kTsPacketSize,
+				 ( numPackets - flushed ) * kTsPacketSize ) )
+		{
+			CI_LOG_E( "Write to remuxer failed - " << ::strerror( errno ) << "." );
+			::close( remuxerFd );
+			remuxerFd = -1;
+		}
+
+		// keep the partial packet at the end for the next read
+		numBuffered -= numPackets * kTsPacketSize;
+		std::memmove( buffer.data(), buffer.data() + numPackets * kTsPacketSize, numBuffered );
+	}
+
+	if ( remuxerFd >= 0 )
+	{
+		writeFully( remuxerFd, buffer.data(), numBuffered );
+		::close( remuxerFd );
+	}
+	for ( pid_t pid : remuxerPids )
+	{
+		if ( pid > 0 )
+		{
+			while ( ::waitpid( pid, nullptr, 0 ) < 0 && errno == EINTR )
+			{ }
+		}
+	}
+}
+
+void FFmpegMovieWriter::setupProgressThread()
+{
+	mProgressThreadShouldQuit = false;
+	mThreadProgress = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &FFmpegMovieWriter::progressThreadFn, this ) ) );
+}
+
+void FFmpegMovieWriter::cleanupProgressThread()
+{
+	mProgressThreadShouldQuit = true;
+	mThreadProgress->join();
+	mThreadProgress.reset();
+}
+
+void FFmpegMovieWriter::progressThreadFn()
+{
+	ThreadSetup threadSetup;
+
+	// non-blocking, so the thread can quit even if ffmpeg never opens the pipe
+	int fd = ::open( mPipeProgress.string().c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC );
+
+	std::string line;
+	char buffer[ 256 ];
+	uint64_t numFramesEncoded = 0;
+
+	for ( ;; )
+	{
+		ssize_t numRead = ::read( fd, buffer, sizeof( buffer ) );
+		if ( numRead <= 0 )
+		{
+			// quit only after the last report has been read
+			if ( mProgressThreadShouldQuit )
+			{
+				break;
+			}
+			ci::sleep( 10 );
+			continue;
+		}
+
+		for ( ssize_t i = 0; i < numRead; i++ )
+		{
+			if ( buffer[ i ] != '\n' )
+			{
+				line += buffer[ i ];
+				continue;
+			}
+
+			if ( line.compare( 0, 6, "frame=" ) == 0 )
+			{
+				uint64_t frame = std::strtoull( line.c_str() + 6, nullptr, 10 );
+				if ( mTracer )
+				{
+					// the count is of encoded frames, which are matched to the
+					// frames in the order they were written, frames added by
+					// an fps filter have no trace id
+					std::lock_guard< std::mutex > lock( mVideoIdsWrittenMutex );
+					for ( ; numFramesEncoded < frame && ! mVideoIdsWritten.empty(); numFramesEncoded++ )
+					{
+						mTracer->record( FFmpegTracer::STREAM_VIDEO, mVideoIdsWritten.front(),
+								FFmpegTracer::STAGE_ENCODED );
+						mVideoIdsWritten.pop_front();
+					}
+				}
+				mNumVideoFramesEncoded = frame;
+			}
+			line.clear();
+		}
+	}
+
+	::close( fd );
+}
+
+void FFmpegMovieWriter::setupVideoThread()
+{
+	if ( mFormat.mVideoPixelFormat != Format::PIXEL_FORMAT_AUTO )
+	{
+		// rows are packed in bands on up to kMaxPackThreads threads
+		mNumPackThreads = std::max( 1u, std::min( std::thread::hardware_concurrency(), kMaxPackThreads ) );
+
+		// conversion buffers, allocated by the first packed frame
+		mMemory->reserve( getPackedFrameSize() +
+				getPackScratchSize( mMovieWidth ) * mNumPackThreads * sizeof( float ) );
+
+		mPackThreadsShouldQuit = false;
+		mPackGeneration = 0;
+		for ( unsigned i = 1; i < mNumPackThreads; i++ )
+		{
+			mPackThreads.push_back( std::shared_ptr< std::thread >( new std::thread(
+						std::bind( &FFmpegMovieWriter::packThreadFn, this, int32_t( i ) ) ) ) );
+		}
+	}
+
+	mVideoFrames = new ConcurrentCircularBuffer< VideoFrame >(
+			mFormat.mStreaming ? kStreamingVideoQueueSize : kVideoQueueSize );
+	mThreadVideo = std::shared_ptr< std::thread >( new std::thread(
+				std::bind( &FFmpegMovieWriter::videoThreadFn, this ) ) );
+}
+
+void FFmpegMovieWriter::cleanupVideoThread()
+{
+	// the video thread quits at the empty frame queued by finalizeThreadFn,
+	// after writing every frame queued before it
+	mThreadVideo->join();
+	mThreadVideo.reset();
+
+	{
+		std::lock_guard< std::mutex > lock( mPackMutex );
+		mPackThreadsShouldQuit = true;
+	}
+	mPackCondition.notify_all();
+	for ( auto &thread : mPackThreads )
+	{
+		thread->join();
+	}
+	mPackThreads.clear();
+}
+
+void FFmpegMovieWriter::videoThreadFn()
+{
+	ThreadSetup threadSetup;
+	SigpipeBlocker sigpipeBlocker;
+
+	int fd = openPipe( mPipeVideo );
+
+	VideoFrame frame;
+	const bool packFrames = mFormat.mVideoPixelFormat != Format::PIXEL_FORMAT_AUTO;
+
+	for ( ;; )
+	{
+		if ( mVideoFrames->isNotEmpty() )
+		{
+			mVideoFrames->popBack( &frame );
+			if ( ! frame )
+			{
+				break;
+			}
+			for ( size_t i = 0; mTracer && i < frame.mNumCopies; i++ )
+			{
+				mTracer->record( FFmpegTracer::STREAM_VIDEO, frame.mId + i, FFmpegTracer::STAGE_DEQUEUE );
+			}
+
+			// without a pipe the queue is still drained, so frames are released
+			if ( fd >= 0 && packFrames )
+			{
+				packVideoFrame( frame );
+			}
+			for ( size_t i = 0; i < frame.mNumCopies && fd >= 0; i++ )
+			{
+				bool written = false;
+				if ( packFrames )
+				{
+					written = writeVideoRows( fd, mPackBuffer.data(), mPackBuffer.size(),
+							mPackBuffer.size(), 1, frame.mId + i );
+				}
+				else
+				{
+					written = writeVideoRows( fd, frame.mData, size_t( frame.mWidth ) * frame.mPixelInc,
+							frame.mRowBytes, frame.mHeight, frame.mId + i );
+				}
+
+				if ( written )
+				{
+					mNumVideoFramesWritten++;
+					if ( mTracer )
+					{
+						std::lock_guard< std::mutex > lock( mVideoIdsWrittenMutex );
+						mVideoIdsWritten.push_back( frame.mId + i );
+					}
+				}
+				else
+				{
+					// ffmpeg is gone, stop writing
+					::close( fd );
+					fd = -1;
+				}
+			}
+
+			mMemory->release( frame.mNumBytes );
+			frame = VideoFrame();
+		}
+		else
+		{
+			ci::sleep( 1 );
+		}
+	}
+
+	if ( fd >= 0 )
+	{
+		::close( fd );
+	}
+}
+
+int FFmpegMovieWriter::openPipe( const fs::path &pipe )
+{
+	// the write end of a fifo only opens once ffmpeg has opened the read end,
+	// poll so an ffmpeg process that fails to start does not block forever
+	while ( ! mFFmpegExited )
+	{
+		int fd = ::open( pipe.string().c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC );
+		if ( fd >= 0 )
+		{
+			::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL ) & ~O_NONBLOCK );
+			return fd;
+		}
+
+		int serrno = errno;
+		if ( serrno != ENXIO && serrno != EINTR )
+		{
+			CI_LOG_E( "Failed to open " << pipe << " - " << ::strerror( serrno ) << "." );
+			return -1;
+		}
+		ci::sleep( 5 );
+	}
+
+	CI_LOG_E( "ffmpeg exited before opening " << pipe << "." );
+	return -1;
+}
+
+bool FFmpegMovieWriter::writeVideoRows( int fd, const uint8_t *data, size_t rowSize,
+		ptrdiff_t rowBytes, int32_t numRows, uint64_t id )
+{
+	// tightly packed rows are written in one go, padded rows are gathered
+	// straight from the source memory
+	if ( ptrdiff_t( rowSize ) == rowBytes )
+	{
+		rowSize *= numRows;
+		numRows = 1;
+	}
+
+	mVideoIovecs.resize( numRows );
+	for ( int32_t y = 0; y < numRows; y++ )
+	{
+		mVideoIovecs[ y ].iov_base = const_cast< uint8_t * >( data + y * rowBytes );
+		mVideoIovecs[ y ].iov_len = rowSize;
+	}
+
+	size_t index = 0;
+	bool firstWrite = true;
+	while ( index < mVideoIovecs.size() )
+	{
+		int count = (int)std::min< size_t >( mVideoIovecs.size() - index, IOV_MAX );
+		ssize_t written = ::writev( fd, &mVideoIovecs[ index ], count );
+		int serrno = errno;
+
+		if ( written < 0 )
+		{
+			if ( serrno == EINTR )
+			{
+				continue;
+			}
+			logWriteError( serrno );
+			return false;
+		}
+
+		if ( mTracer && firstWrite && written > 0 )
+		{
+			mTracer->record( FFmpegTracer::STREAM_VIDEO, id, FFmpegTracer::STAGE_WRITE_BEGIN );
+			firstWrite = false;
+		}
+
+		while ( written > 0 )
+		{
+			iovec &iov = mVideoIovecs[ index ];
+			if ( size_t( written ) >= iov.iov_len )
+			{
+				written -= iov.iov_len;
+				index++;
+			}
+			else
+			{
+				iov.iov_base = static_cast< uint8_t * >( iov.iov_base ) + written;
+				iov.iov_len -= written;
+				written = 0;
+			}
+		}
+
+	}
+
+	if ( mTracer )
+	{
+		mTracer->record( FFmpegTracer::STREAM_VIDEO, id, FFmpegTracer::STAGE_WRITE_END );
+	}
+	return true;
+}
+
+size_t FFmpegMovieWriter::getPackedFrameSize() const
+{
+	const size_t planeSize = size_t( mMovieWidth ) * mMovieHeight;
+	const size_t chromaPlaneSize = size_t( ( mMovieWidth + 1 ) / 2 ) *
+		( ( mMovieHeight + 1 ) / 2 );
+
+	switch ( mFormat.mVideoPixelFormat )
+	{
+		case Format::PIXEL_FORMAT_RGB48:
+		case Format::PIXEL_FORMAT_GBRP16:
+			return planeSize * 3 * sizeof( uint16_t );
+
+		case Format::PIXEL_FORMAT_YUV420P10:
+		case Format::PIXEL_FORMAT_P010:
+			return ( planeSize + chromaPlaneSize * 2 ) * sizeof( uint16_t );
+
+		default:
+			return 0;
+	}
+}
+
+size_t FFmpegMovieWriter::getPackScratchSize( int32_t width )
+{
+	// two rows of up to four channels, then the averaged chroma rows
+	return size_t( width ) * 8 + size_t( ( width + 1 ) / 2 ) * 3;
+}
+
+void FFmpegMovieWriter::packVideoFrame( const VideoFrame &frame )
+{
+	const int32_t height = frame.mHeight;
+	const size_t scratchSize = getPackScratchSize( frame.mWidth );
+
+	mPackBuffer.resize( getPackedFrameSize() );
+	mPackRows.resize( scratchSize * mNumPackThreads );
+
+	// bands of whole row pairs, so each band owns its chroma rows
+	const int32_t numRowPairs = ( height + 1 ) / 2;
+	const int32_t numBands = std::max( 1, std::min( int32_t( mNumPackThreads ), numRowPairs ) );
+
+	// the pack threads take the other bands
+	if ( numBands > 1 )
+	{
+		{
+			std::lock_guard< std::mutex > lock( mPackMutex );
+			mPackFrame = &frame;
+			mNumPackBands = numBands;
+			mNumPackBandsPending = numBands - 1;
+			mPackGeneration++;
+		}
+		mPackCondition.notify_all();
+	}
+
+	packVideoBand( frame, 0, numBands );
+
+	std::unique_lock< std::mutex > lock( mPackMutex );
+	mPackDoneCondition.wait( lock, [ & ] { return mNumPackBandsPending == 0; } );
+	mPackFrame = nullptr;
+}
+
+void FFmpegMovieWriter::packVideoBand( const VideoFrame &frame, int32_t band, int32_t numBands )
+{
+	const int32_t height = frame.mHeight;
+	const int32_t numRowPairs = ( height + 1 ) / 2;
+	const int32_t y0 = numRowPairs * band / numBands * 2;
+	const int32_t y1 = std::min( numRowPairs * ( band + 1 ) / numBands * 2, height );
+	packVideoRows( frame, y0, y1, mPackRows.data() + getPackScratchSize( frame.mWidth ) * band );
+}
+
+void FFmpegMovieWriter::packThreadFn( int32_t band )
+{
+	ThreadSetup threadSetup;
+
+	uint64_t generation = 0;
+	for ( ;; )
+	{
+		const VideoFrame *frame = nullptr;
+		int32_t numBands = 0;
+		{
+			std::unique_lock< std::mutex > lock( mPackMutex );
+			mPackCondition.wait( lock, [ & ] { return mPackThreadsShouldQuit || mPackGeneration != generation; } );
+			if ( mPackThreadsShouldQuit )
+			{
+				break;
+			}
+			generation = mPackGeneration;
+			frame = mPackFrame;
+			numBands = mNumPackBands;
+		}
+
+		// frames with fewer row pairs than threads leave the last workers idle
+		if ( band >= numBands )
+		{
+			continue;
+		}
+
+		packVideoBand( *frame, band, numBands );
+
+		bool done = false;
+		{
+			std::lock_guard< std::mutex > lock( mPackMutex );
+			done = --mNumPackBandsPending == 0;
+		}
+		if ( done )
+		{
+			mPackDoneCondition.notify_one();
+		}
+	}
+}
+
+void FFmpegMovieWriter::packVideoRows( const VideoFrame &frame, int32_t y0, int32_t y1, float *scratch )
+{
+	const int32_t width = frame.mWidth;
+	const int32_t height = frame.mHeight;
+	const int32_t chromaWidth = ( width + 1 ) / 2;
+	const size_t planeSize = size_t( width ) * height;
+	const size_t chromaPlaneSize = size_t( chromaWidth ) * ( ( height + 1 ) / 2 );
+	uint16_t *dst = reinterpret_cast< uint16_t * >( mPackBuffer.data() );
+
+	const bool yuv = mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_YUV420P10 ||
+		mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_P010;
+	// p010 stores 10-bit samples in the high bits of each 16-bit word
+	const int shift = mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_P010 ? 6 : 0;
+
+	// limited range BT.2020 for the HDR transfer functions, BT.709 otherwise
+	const bool wideGamut = mFormat.mVideoTransferFunction == Format::TRANSFER_PQ ||
+		mFormat.mVideoTransferFunction == Format::TRANSFER_HLG;
+	const float kr = wideGamut ? 0.2627f : 0.2126f;
+	const float kb = wideGamut ? 0.0593f : 0.0722f;
+	const float kg = 1.0f - kr - kb;
+
+	float *chroma = scratch + size_t( width ) * 8;
+	float *cr = chroma;
+	float *cg = cr + chromaWidth;
+	float *cb = cg + chromaWidth;
+
+	for ( int32_t y = y0; y < y1; y++ )
+	{
+		float *channels = scratch + ( y & 1 ) * width * 4;
+		const uint8_t *src = frame.mData + y * frame.mRowBytes;
+		switch ( frame.mDepth )
+		{
+			case VideoFrame::DEPTH_8U:
+				unpackRow< uint8_t >( src, width, frame.mPixelInc, 1.0f / 255.0f, channels );
+				break;
 
-	if ( mFormat.mRecordVideo )
-	{
-		const std::vector< std::string > pixelFormats = { "rgba", "bgra", "argb", "abgr",
-			"rgb0", "bgr0", "0rgb", "0bgr", "rgb24", "bgr24" };
+			case VideoFrame::DEPTH_16U:
+				unpackRow< uint16_t >( src, width, frame.mPixelInc, 1.0f / 65535.0f, channels );
+				break;
+
+			case VideoFrame::DEPTH_32F:
+				unpackRow< float >( src, width, frame.mPixelInc, 1.0f, channels );
+				break;
+		}
 
-		int code = mFormat.mVideoChannelOrder.getCode();
-		std::string pixelFormat = "rgb24";
-		if ( code < pixelFormats.size() )
+		float *r = channels + frame.mRedOffset * width;
+		float *g = channels + frame.mGreenOffset * width;
+		float *b = channels + frame.mBlueOffset * width;
+
+		// the input is linear Rec.709, the transfer function encodes it in [0, 1]
+		if ( wideGamut )
 		{
-			pixelFormat = pixelFormats[ code ];
+			convertRec709ToBt2020( r, g, b, width );
 		}
-		cmd << " -r "<< mFormat.mFrameRate <<
-			" -s " << mMovieWidth << "x" << mMovieHeight <<
-			" -f rawvideo -pix_fmt " << pixelFormat <<
-			" -i \"" << mPipeVideo.string() << "\" -r " << mFormat.mFrameRate;
-	}
-	else
-	{
-		cmd << " -vn";
-	}
-	cmd << " " + outputSettings.str() + "' &";
-	std::string command = cmd.str();
+		applyTransferFunction( mFormat.mVideoTransferFunction, r, width );
+		applyTransferFunction( mFormat.mVideoTransferFunction, g, width );
+		applyTransferFunction( mFormat.mVideoTransferFunction, b, width );
 
+		if ( mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_RGB48 )
+		{
+			uint16_t *row = dst + size_t( y ) * width * 3;
+			for ( int32_t x = 0; x < width; x++ )
+			{
+				row[ x * 3 ] = toComponent16( r[ x ] );
+				row[ x * 3 + 1 ] = toComponent16( g[ x ] );
+				row[ x * 3 + 2 ] = toComponent16( b[ x ] );
+			}
+		}
+		else
+		if ( mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_GBRP16 )
+		{
+			const size_t offset = size_t( y ) * width;
+			for ( int32_t x = 0; x < width; x++ )
+			{
+				dst[ offset + x ] = toComponent16( g[ x ] );
+				dst[ planeSize + offset + x ] = toComponent16( b[ x ] );
+				dst[ planeSize * 2 + offset + x ] = toComponent16( r[ x ] );
+			}
+		}
+		else
+		if ( yuv )
+		{
+			uint16_t *luma = dst + size_t( y ) * width;
+			for ( int32_t x = 0; x < width; x++ )
+			{
+				const float l = kr * r[ x ] + kg * g[ x ] + kb * b[ x ];
+				luma[ x ] = uint16_t( uint16_t( 64.0f + l * 876.0f + 0.5f ) << shift );
+			}
 
-	int result = system( command.c_str() );
-	int serrno = errno;
-	if ( result == 0 )
-	{
-		CI_LOG_I( command << " command completed." );
-		mThreadFFmpegInitialized = true;
-	}
-	else
-	{
-		CI_LOG_E( command << " command failed with result: " << result
-							<< " - " << ::strerror( serrno ) << "." );
-		// TODO: throw
-	}
+			// 2x2 chroma blocks, an odd last row is paired with itself
+			if ( ( y & 1 ) == 0 && y + 1 < height )
+			{
+				continue;
+			}
 
-	if ( mFormat.mRecordAudio )
-	{
-		setupAudioThread();
-	}
-	if ( mFormat.mRecordVideo )
-	{
-		setupVideoThread();
+			const float *channels0 = scratch;
+			downsampleRows( channels0 + frame.mRedOffset * width, r, width, cr );
+			downsampleRows( channels0 + frame.mGreenOffset * width, g, width, cg );
+			downsampleRows( channels0 + frame.mBlueOffset * width, b, width, cb );
+
+			const size_t chromaOffset = size_t( y / 2 ) * chromaWidth;
+			if ( shift )
+			{
+				uint16_t *uv = dst + planeSize + chromaOffset * 2;
+				packChromaRow< 2 >( cr, cg, cb, chromaWidth, kr, kb, shift, uv, uv + 1 );
+			}
+			else
+			{
+				packChromaRow< 1 >( cr, cg, cb, chromaWidth, kr, kb, shift,
+						dst + planeSize + chromaOffset,
+						dst + planeSize + chromaPlaneSize + chromaOffset );
+			}
+		}
 	}
 }
 
-void FFmpegMovieWriter::cleanupFFmpeg()
+template< typename T >
+FFmpegMovieWriter::VideoFrame FFmpegMovieWriter::createVideoFrame(
+		const std::shared_ptr< SurfaceT< T > > &surface, typename VideoFrame::Depth depth )
 {
-	mThreadFFmpeg->join();
-	mThreadFFmpeg.reset();
-
-	if ( mFormat.mRecordVideo )
-	{
-		fs::remove( mPipeVideo );
-	}
-	if ( mFormat.mRecordAudio )
+	VideoFrame frame;
+	if ( ! surface )
 	{
-		fs::remove( mPipeAudio );
+		return frame;
 	}
-}
 
-void FFmpegMovieWriter::setupVideoThread()
-{
-	mVideoThreadShouldQuit = false;
-	mVideoFrames = new ConcurrentCircularBuffer< Surface8uRef >( 10 );
-	mThreadVideo = std::shared_ptr< std::thread >( new std::thread(
-				std::bind( &FFmpegMovieWriter::videoThreadFn, this ) ) );
+	frame.mOwner = surface;
+	frame.mData = reinterpret_cast< const uint8_t * >( surface->getData() );
+	frame.mWidth = surface->getWidth();
+	frame.mHeight = surface->getHeight();
+	frame.mRowBytes = surface->getRowBytes();
+	frame.mDepth = depth;
+	frame.mPixelInc = surface->getPixelInc();
+	frame.mRedOffset = surface->getRedOffset();
+	frame.mGreenOffset = surface->getGreenOffset();
+	frame.mBlueOffset = surface->getBlueOffset();
+	return frame;
 }
 
-void FFmpegMovieWriter::cleanupVideoThread()
+void FFmpegMovieWriter::addFrame( Surface8uRef surface )
 {
-	mVideoThreadShouldQuit = true;
-	mVideoFrames->cancel();
-	mThreadVideo->join();
-	mThreadVideo.reset();
-	delete mVideoFrames;
-	mVideoFrames = nullptr;
+	addVideoFrame( createVideoFrame( surface, VideoFrame::DEPTH_8U ) );
 }
 
-void FFmpegMovieWriter::videoThreadFn()
+void FFmpegMovieWriter::addFrame( Surface8uRef surface, const Area &area )
 {
-	ThreadSetup threadSetup;
-
-	int fd = ::open( mPipeVideo.string().c_str(), O_WRONLY );
+	VideoFrame frame = createVideoFrame( surface, VideoFrame::DEPTH_8U );
+	if ( ! frame )
+	{
+		return;
+	}
 
-	Surface8uRef frame;
+	Area clippedArea = area;
+	clippedArea.clipBy( surface->getBounds() );
+	frame.mData += clippedArea.getY1() * frame.mRowBytes +
+		clippedArea.getX1() * frame.mPixelInc;
+	frame.mWidth = clippedArea.getWidth();
+	frame.mHeight = clippedArea.getHeight();
+	addVideoFrame( frame );
+}
 
-	while ( ! mVideoThreadShouldQuit )
+void FFmpegMovieWriter::addFrame( const void *data, int32_t width, int32_t height,
+		ptrdiff_t rowBytes, const SurfaceChannelOrder &channelOrder,
+		const std::function< void() > &releaseFn )
+{
+	const ptrdiff_t minRowBytes = (ptrdiff_t)width * channelOrder.getPixelInc();
+	if ( ! data || std::abs( rowBytes ) < minRowBytes )
 	{
-		if ( mVideoFrames->isNotEmpty() )
+		if ( ! data )
 		{
-			mVideoFrames->popBack( &frame );
-			if ( ! frame )
-			{
-				break;
-			}
-
-			int offset = 0;
-			int remaining = frame->getWidth() * frame->getHeight() *
-				frame->getPixelBytes();
+			CI_LOG_W( "Frame has no pixel data, dropping video frame" );
+		}
+		else
+		{
+			CI_LOG_W( "Frame row bytes " << rowBytes << " are less than the " << minRowBytes <<
+					" bytes of a row, dropping video frame" );
+		}
+		if ( releaseFn )
+		{
+			releaseFn();
+		}
+		return;
+	}
 
-			while ( remaining > 0 )
+	VideoFrame frame;
+	// the release function runs when the last queued copy of the frame is
+	// written, or right away if the frame is dropped
+	frame.mOwner = std::shared_ptr< const void >( data,
+			[ releaseFn ]( const void * )
 			{
-				int written = ::write( fd, (char *)frame->getData() +
-						offset, remaining );
-				int serrno = errno;
-
-				if ( written > 0 )
-				{
-					remaining -= written;
-					offset += written;
-				}
-				else
-				if ( written < 0 )
-				{
-					CI_LOG_E( "Write to pipe failed with error -> " << serrno
-							<< " - " << ::strerror( serrno ) << "." );
-					break;
-				}
-
-				if ( mVideoThreadShouldQuit )
+				if ( releaseFn )
 				{
-					break;
+					releaseFn();
 				}
-			}
+			} );
+	frame.mData = static_cast< const uint8_t * >( data );
+	frame.mWidth = width;
+	frame.mHeight = height;
+	frame.mRowBytes = rowBytes;
+	frame.mDepth = VideoFrame::DEPTH_8U;
+	frame.mPixelInc = channelOrder.getPixelInc();
+	frame.mRedOffset = channelOrder.getRedOffset();
+	frame.mGreenOffset = channelOrder.getGreenOffset();
+	frame.mBlueOffset = channelOrder.getBlueOffset();
+	addVideoFrame( frame );
+}
 
-			frame.reset();
-		}
-		else
-		{
-			ci::sleep( 1 );
-		}
+void FFmpegMovieWriter::addFrame( Surface16uRef surface )
+{
+	if ( mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_AUTO )
+	{
+		CI_LOG_W( "16-bit frames require a high bit depth pixel format, dropping video frame" );
+		return;
 	}
+	addVideoFrame( createVideoFrame( surface, VideoFrame::DEPTH_16U ) );
+}
 
-	::close( fd );
+void FFmpegMovieWriter::addFrame( Surface32fRef surface )
+{
+	if ( mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_AUTO )
+	{
+		CI_LOG_W( "Float frames require a high bit depth pixel format, dropping video frame" );
+		return;
+	}
+	addVideoFrame( createVideoFrame( surface, VideoFrame::DEPTH_32F ) );
 }
 
-void FFmpegMovieWriter::addFrame( SurfaceRef surface )
+void FFmpegMovieWriter::addVideoFrame( const VideoFrame &frame )
 {
-	if ( ! mThreadFFmpegInitialized )
+	if ( ! mThreadFFmpegInitialized || mFinalizing )
 	{
 		CI_LOG_W( "Dropping video frame" );
 		return;
 	}
-	if ( ! mVideoFrames )
+	if ( mPaused )
+	{
+		return;
+	}
+	if ( ! mVideoFrames || ! frame )
+	{
+		return;
+	}
+	if ( frame.mWidth != mMovieWidth || frame.mHeight != mMovieHeight )
 	{
+		CI_LOG_W( "Frame size " << frame.mWidth << "x" << frame.mHeight <<
+				" does not match movie size " << mMovieWidth << "x" << mMovieHeight <<
+				", dropping video frame" );
 		return;
 	}
+	if ( mFormat.mVideoPixelFormat == Format::PIXEL_FORMAT_AUTO )
+	{
+		// the pixels are piped as they are, in the video channel order
+		const SurfaceChannelOrder &channelOrder = mFormat.mVideoChannelOrder;
+		if ( frame.mPixelInc != channelOrder.getPixelInc() ||
+			 frame.mRedOffset != channelOrder.getRedOffset() ||
+			 frame.mGreenOffset != channelOrder.getGreenOffset() ||
+			 frame.mBlueOffset != channelOrder.getBlueOffset() )
+		{
+			CI_LOG_W( "Frame channel order does not match the video channel order, dropping video frame" );
+			return;
+		}
+	}
 
 	size_t numFramesToAdd = 1;
 
 	if ( mFormat.mRecordAudio )
 	{
 		double videoRecordedTime = mNumVideoFramesRecorded / mFormat.mFrameRate;
-		double audioRecordedTime = mNumAudioSamplesRecorded /
-			(double)mFormat.mAudioSampleRate;
+		// the first audio track is the clock
+		const AudioTrackState &track = mAudioTracks[ 0 ];
+		double audioRecordedTime = track.mNumSamplesRecorded / (double)track.mSampleRate;
 		double syncDelta = audioRecordedTime - videoRecordedTime;
 		const double frameTime = 1.0 / mFormat.mFrameRate;
 
@@ -322,6 +2339,7 @@ void FFmpegMovieWriter::addFrame( SurfaceRef surface )
 				numFramesToAdd++;
 				syncDelta -= frameTime;
 			}
+			mNumVideoFramesRepeated += numFramesToAdd - 1;
 			CI_LOG_I( "recDelta = " << syncDelta << ". Not enough video frames for desired frame rate, copied this frame " << numFramesToAdd << " times." << audioRecordedTime << " v: " << videoRecordedTime );
 		}
 		else
@@ -329,42 +2347,161 @@ void FFmpegMovieWriter::addFrame( SurfaceRef surface )
 		{
 			// more than one video frame is waiting, skip this frame
 			numFramesToAdd = 0;
+			mNumVideoFramesSkipped++;
 			CI_LOG_I( "recDelta = " << syncDelta << ". Too many video frames, skipping." );
 		}
 	}
 
-	for ( size_t i = 0; i < numFramesToAdd; i++ )
+	// trace ids are not reused when queued frames are dropped
+	const uint64_t id = mNumVideoFramesSubmitted;
+	mNumVideoFramesSubmitted += numFramesToAdd;
+	for ( size_t i = 0; mTracer && i < numFramesToAdd; i++ )
 	{
-		mVideoFrames->pushFront( surface );
-		mNumVideoFramesRecorded++;
+		mTracer->record( FFmpegTracer::STREAM_VIDEO, id + i, FFmpegTracer::STAGE_SUBMIT );
+	}
+
+	if ( numFramesToAdd == 0 )
+	{
+		return;
+	}
+
+	// repeats are a single queue entry, the frame is charged once and
+	// released after its last copy is written
+	VideoFrame queuedFrame = frame;
+	queuedFrame.mId = id;
+	queuedFrame.mNumCopies = numFramesToAdd;
+	queuedFrame.mNumBytes = size_t( std::abs( frame.mRowBytes ) ) * frame.mHeight;
+	bool queued = acquireVideoMemory( &queuedFrame );
+	if ( ! queued )
+	{ }
+	else
+	if ( ! mFormat.mStreaming )
+	{
+		mVideoFrames->pushFront( queuedFrame );
+	}
+	else
+	if ( ! mVideoFrames->tryPushFront( queuedFrame ) )
+	{
+		// never block the caller when streaming, replace the oldest
+		// queued frame with the fresh one instead
+		VideoFrame staleFrame;
+		if ( mVideoFrames->tryPopBack( &staleFrame ) )
+		{
+			dropVideoFrame( staleFrame, &queuedFrame );
+		}
+		queued = mVideoFrames->tryPushFront( queuedFrame );
+		if ( ! queued )
+		{
+			mMemory->release( queuedFrame.mNumBytes );
+		}
+	}
+	if ( ! queued )
+	{
+		// the copies taken over from dropped frames are lost as well
+		mNumVideoFramesRecorded -= queuedFrame.mNumCopies - numFramesToAdd;
+		mNumVideoFramesRepeated -= numFramesToAdd - 1;
+		mNumVideoFramesDropped++;
+		return;
+	}
+	for ( size_t i = 0; mTracer && i < numFramesToAdd; i++ )
+	{
+		mTracer->record( FFmpegTracer::STREAM_VIDEO, queuedFrame.mId + i,
+				FFmpegTracer::STAGE_ENQUEUE );
+	}
+	mNumVideoFramesRecorded += numFramesToAdd;
+}
+
+bool FFmpegMovieWriter::acquireVideoMemory( VideoFrame *frame )
+{
+	const size_t bytes = frame->mNumBytes;
+	Format::MemoryPolicy policy = mFormat.mMemoryPolicy;
+	if ( mFormat.mStreaming && policy == Format::MEMORY_POLICY_BLOCK )
+	{
+		policy = Format::MEMORY_POLICY_DROP_OLDEST;
+	}
+
+	if ( policy == Format::MEMORY_POLICY_BLOCK )
+	{
+		return mMemory->acquire( bytes, true );
+	}
+
+	// once the size of the frame is freed the rest of the budget is held by
+	// other writers, dropping more of the queue would not help
+	size_t numBytesFreed = 0;
+	while ( ! mMemory->acquire( bytes, false ) )
+	{
+		VideoFrame staleFrame;
+		if ( policy == Format::MEMORY_POLICY_DROP_NEWEST || numBytesFreed >= bytes ||
+			 mMemory->isCanceled() || ! mVideoFrames->tryPopBack( &staleFrame ) )
+		{
+			return false;
+		}
+		// make room by dropping the oldest queued frame
+		numBytesFreed += staleFrame.mNumBytes;
+		dropVideoFrame( staleFrame, frame );
+	}
+	return true;
+}
+
+void FFmpegMovieWriter::dropVideoFrame( const VideoFrame &frame, VideoFrame *survivor )
+{
+	mMemory->release( frame.mNumBytes );
+	mNumVideoFramesDropped++;
+	if ( mFormat.mRecordAudio )
+	{
+		// the recorded count has to match what reaches the encoder to stay in
+		// sync with the audio, the newer frame is repeated in its place, the
+		// repeats of the dropped frame become repeats of the newer one
+		survivor->mNumCopies += frame.mNumCopies;
+		mNumVideoFramesRepeated++;
+	}
+	else
+	{
+		mNumVideoFramesRecorded -= frame.mNumCopies;
+		mNumVideoFramesRepeated -= frame.mNumCopies - 1;
 	}
 }
 
 void FFmpegMovieWriter::setupAudioThread()
 {
-	mAudioThreadShouldQuit = false;
-	mAudioFrames = new ConcurrentCircularBuffer< AudioFrame * >( 20 );
+	const size_t queueSize = mFormat.mStreaming ? kStreamingAudioQueueSize : kAudioQueueSize;
+	mAudioFrames = new ConcurrentCircularBuffer< AudioFrame * >( queueSize );
+	// room for every queued frame, the one being written and the ones being filled
+	mAudioFramePool = new ConcurrentCircularBuffer< AudioFrame * >( queueSize + 1 + mAudioTracks.size() );
+	size_t maxNumChannels = 1;
+	for ( const auto &track : mAudioTracks )
+	{
+		maxNumChannels = std::max( maxNumChannels, track.mNumChannels );
+	}
+	mAudioSilence.assign( kAudioSilenceFrames * maxNumChannels, 0.0f );
+	// the stream header ends with a cluster at 0
+	mAudioClusterStarted = true;
+	mAudioClusterTimestamp = 0;
 	mThreadAudio = std::shared_ptr< std::thread >( new std::thread(
 				std::bind( &FFmpegMovieWriter::audioThreadFn, this ) ) );
 }
 
 void FFmpegMovieWriter::cleanupAudioThread()
 {
-	mAudioThreadShouldQuit = true;
-	mAudioFrames->cancel();
+	// the audio thread quits at the null frame queued by finalizeThreadFn
 	mThreadAudio->join();
 	mThreadAudio.reset();
-	delete mAudioFrames;
-	mAudioFrames = nullptr;
 }
 
 void FFmpegMovieWriter::audioThreadFn()
 {
 	ThreadSetup threadSetup;
+	SigpipeBlocker sigpipeBlocker;
 
-	int fd = ::open( mPipeAudio.string().c_str(), O_WRONLY );
+	int fd = openPipe( mPipeAudio );
+	if ( fd >= 0 && ! writeFully( fd, mAudioStreamHeader.data(), mAudioStreamHeader.size() ) )
+	{
+		logWriteError( errno );
+		::close( fd );
+		fd = -1;
+	}
 
-	while ( ! mAudioThreadShouldQuit )
+	for ( ;; )
 	{
 		AudioFrame *frame = nullptr;
 
@@ -375,37 +2512,47 @@ void FFmpegMovieWriter::audioThreadFn()
 			{
 				break;
 			}
+			if ( mTracer )
+			{
+				mTracer->record( FFmpegTracer::STREAM_AUDIO, frame->mId, FFmpegTracer::STAGE_DEQUEUE );
+			}
 
-			int offset = 0;
-			int remaining = frame->mSize * sizeof( float );
-
-			while ( remaining > 0 )
+			// buffers dropped before this one are written as silence, so the
+			// track stays in sync with the video
+			if ( fd >= 0 && ! writeAudioSilence( fd, frame->mTrack, frame->mPosition ) )
 			{
-				int written = ::write( fd, (uint8_t *)frame->mData + offset,
-						remaining );
-				int serrno = errno;
+				::close( fd );
+				fd = -1;
+			}
 
-				if ( written > 0 )
+			if ( fd >= 0 )
+			{
+				if ( mTracer )
 				{
-					remaining -= written;
-					offset += written;
+					mTracer->record( FFmpegTracer::STREAM_AUDIO, frame->mId,
+							FFmpegTracer::STAGE_WRITE_BEGIN );
 				}
-				else
-				if ( written < 0 )
+				if ( writeAudioBlock( fd, frame->mTrack, frame->mPosition, frame->mData, frame->mNumFrames ) )
 				{
-					CI_LOG_E( "Write to pipe failed with error -> " << serrno
-							<< " - " << strerror( serrno ) << "." );
-					break;
+					if ( mTracer )
+					{
+						mTracer->record( FFmpegTracer::STREAM_AUDIO, frame->mId, FFmpegTracer::STAGE_WRITE_END );
+					}
 				}
-
-				if ( mAudioThreadShouldQuit )
+				else
 				{
-					break;
+					// ffmpeg is gone, keep draining without writing
+					::close( fd );
+					fd = -1;
 				}
 			}
 
-			delete [] frame->mData;
-			delete frame;
+			const size_t numBytes = frame->mSize * sizeof( float );
+			mMemory->release( numBytes );
+			if ( ! mAudioFramePool->tryPushFront( frame ) )
+			{
+				delete frame;
+			}
 			frame = nullptr;
 		}
 		else
@@ -414,37 +2561,190 @@ void FFmpegMovieWriter::audioThreadFn()
 		}
 	}
 
-	::close( fd );
+	// as are the buffers dropped at the end
+	for ( size_t i = 0; i < mAudioTracks.size() && fd >= 0; i++ )
+	{
+		if ( ! writeAudioSilence( fd, i, mAudioTracks[ i ].mNumSamplesRecorded ) )
+		{
+			::close( fd );
+			fd = -1;
+		}
+	}
+
+	if ( fd >= 0 )
+	{
+		::close( fd );
+	}
+}
+
+bool FFmpegMovieWriter::writeAudioSilence( int fd, size_t trackId, uint64_t position )
+{
+	AudioTrackState &track = mAudioTracks[ trackId ];
+	while ( track.mNumSamplesWritten < position )
+	{
+		const size_t numFrames = size_t( std::min< uint64_t >( position - track.mNumSamplesWritten,
+					mAudioSilence.size() / track.mNumChannels ) );
+		if ( ! writeAudioBlock( fd, trackId, track.mNumSamplesWritten, mAudioSilence.data(), numFrames ) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FFmpegMovieWriter::writeAudioBlock( int fd, size_t trackId, uint64_t position,
+		const float *data, size_t numFrames )
+{
+	AudioTrackState &track = mAudioTracks[ trackId ];
+	const uint64_t timestamp = track.getTimestamp( position );
+
+	// the block header is assembled on the stack and gathered with the
+	// samples, a cluster is started when the block offset runs out of range,
+	// the tracks are interleaved in the order they arrive
+	uint8_t header[ kAudioBlockHeaderSize ];
+	size_t headerSize = 0;
+	if ( ! mAudioClusterStarted || timestamp < mAudioClusterTimestamp ||
+		 timestamp - mAudioClusterTimestamp >= kAudioClusterDuration )
+	{
+		mAudioClusterStarted = true;
+		mAudioClusterTimestamp = timestamp;
+		headerSize += putEbmlId( header + headerSize, kMkvCluster );
+		headerSize += putEbmlSize( header + headerSize, kEbmlUnknownSize );
+		headerSize += putEbmlId( header + headerSize, kMkvClusterTimestamp );
+		headerSize += putEbmlSize( header + headerSize, 8 );
+		headerSize += putBigEndian( header + headerSize, mAudioClusterTimestamp, 8 );
+	}
+
+	const size_t numBytes = numFrames * track.mNumChannels * sizeof( float );
+	headerSize += putEbmlId( header + headerSize, kMkvSimpleBlock );
+	headerSize += putEbmlSize( header + headerSize, 4 + numBytes );
+	header[ headerSize++ ] = uint8_t( 0x80 | ( trackId + 1 ) );
+	headerSize += putBigEndian( header + headerSize, timestamp - mAudioClusterTimestamp, 2 );
+	// keyframe
+	header[ headerSize++ ] = 0x80;
+
+	iovec iov[ 2 ] = { { header, headerSize }, { const_cast< float * >( data ), numBytes } };
+	if ( ! writeFully( fd, iov, 2 ) )
+	{
+		logWriteError( errno );
+		return false;
+	}
+	track.mNumSamplesWritten += numFrames;
+	return true;
 }
 
 void FFmpegMovieWriter::addAudioBuffer( const audio::Buffer *buffer )
 {
-	if ( ! mThreadFFmpegInitialized )
+	addAudioBuffer( 0, buffer );
+}
+
+void FFmpegMovieWriter::addAudioBuffer( size_t trackId, const audio::Buffer *buffer )
+{
+	if ( ! mThreadFFmpegInitialized || mFinalizing )
 	{
 		CI_LOG_W( "Dropping audio frame" );
 		return;
 	}
+	if ( mPaused )
+	{
+		return;
+	}
 	if ( ! mAudioFrames )
 	{
 		return;
 	}
+	if ( trackId >= mAudioTracks.size() )
+	{
+		CI_LOG_W( "Audio track " << trackId << " does not exist, dropping audio frame" );
+		return;
+	}
+
+	const uint64_t id = mNumAudioFramesSubmitted++;
+	if ( mTracer )
+	{
+		mTracer->record( FFmpegTracer::STREAM_AUDIO, id, FFmpegTracer::STAGE_SUBMIT );
+	}
+
+	AudioTrackState &track = mAudioTracks[ trackId ];
+	const size_t numChannels = track.mNumChannels;
+	const size_t numFrames = buffer->getNumFrames();
+	const size_t size = numFrames * numChannels;
+
+	uint64_t startTime = track.mStartTime;
+	if ( startTime == AudioTrackState::kNotStarted )
+	{
+		// the buffer holds the latest audio of the source, so it ends where
+		// the first track currently is
+		const AudioTrackState &firstTrack = mAudioTracks[ 0 ];
+		const uint64_t duration = numFrames * 1000 / track.mSampleRate;
+		const uint64_t time = firstTrack.isStarted() ? firstTrack.getTime() : 0;
+		track.mStartTime.compare_exchange_strong( startTime, time > duration ? time - duration : 0 );
+	}
+
+	// dropped buffers keep their place on the timeline and are written as
+	// silence, so the first track keeps pacing the video
+	const uint64_t position = track.mNumSamplesRecorded.fetch_add( numFrames );
+
+	// this runs on the audio thread, which must never wait, so audio is
+	// dropped as it arrives whatever the memory policy
+	if ( ! mMemory->acquire( size * sizeof( float ), false ) )
+	{
+		mNumAudioFramesDropped++;
+		return;
+	}
 
-	size_t size = buffer->getSize();
-	AudioFrame *samples = new AudioFrame;
-	samples->mData = new float[ size ];
+	AudioFrame *samples = nullptr;
+	if ( ! mAudioFramePool->tryPopBack( &samples ) )
+	{
+		samples = new AudioFrame;
+	}
+	if ( samples->mCapacity < size )
+	{
+		delete [] samples->mData;
+		samples->mData = new float[ size ];
+		samples->mCapacity = size;
+	}
 	samples->mSize = size;
-	const float *ch0 = buffer->getChannel( 0 );
-	const float *ch1 = buffer->getChannel( 1 );
-	size_t numFrames = buffer->getNumFrames();
-	mNumAudioSamplesRecorded += numFrames;
+	samples->mNumFrames = numFrames;
+	samples->mTrack = trackId;
+	samples->mPosition = position;
+	samples->mId = id;
+
+	for ( size_t ch = 0; ch < numChannels; ch++ )
+	{
+		float *dst = samples->mData + ch;
+		if ( ch < buffer->getNumChannels() )
+		{
+			const float *src = buffer->getChannel( ch );
+			for ( size_t i = 0; i < numFrames; i++ )
+			{
+				dst[ i * numChannels ] = src[ i ];
+			}
+		}
+		else
+		{
+			for ( size_t i = 0; i < numFrames; i++ )
+			{
+				dst[ i * numChannels ] = 0.0f;
+			}
+		}
+	}
 
-	for ( size_t i = 0; i < numFrames; i++ )
+	if ( ! mAudioFrames->tryPushFront( samples ) )
 	{
-		samples->mData[ i * 2 ] = ch0[ i ];
-		samples->mData[ i * 2 + 1 ] = ch1[ i ];
+		mNumAudioFramesDropped++;
+		mMemory->release( size * sizeof( float ) );
+		if ( ! mAudioFramePool->tryPushFront( samples ) )
+		{
+			delete samples;
+		}
+		return;
 	}
 
-	mAudioFrames->pushFront( samples );
+	if ( mTracer )
+	{
+		mTracer->record( FFmpegTracer::STREAM_AUDIO, id, FFmpegTracer::STAGE_ENQUEUE );
+	}
 }
 
 }
@@ -23,32 +23,109 @@
 
 #pragma once
 
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "cinder/Color.h"
 #include "cinder/ConcurrentCircularBuffer.h"
+#include "cinder/Exception.h"
 #include "cinder/Filesystem.h"
 #include "cinder/Surface.h"
 #include "cinder/Thread.h"
+#include "cinder/Vector.h"
 #include "cinder/audio/Buffer.h"
 
+#include "FFmpegMemoryGovernor.h"
+#include "FFmpegTracer.h"
+
 namespace mndl {
 
 typedef std::shared_ptr< class FFmpegMovieWriter > FFmpegMovieWriterRef;
 
+class FFmpegMovieWriterExc : public ci::Exception
+{
+ public:
+	FFmpegMovieWriterExc( const std::string &description ) : ci::Exception( description ) {}
+};
+
 class FFmpegMovieWriter
 {
  public:
+	//! Video processing step run multithreaded inside the ffmpeg process before encoding, see Format::filter().
+	class Filter
+	{
+	 public:
+		enum Type { TYPE_TIMECODE, TYPE_OVERLAY, TYPE_PAD, TYPE_SCALE, TYPE_FPS };
+
+		//! Burns in a running HH:MM:SS:FF timecode. Negative coordinates are measured from the right and bottom edges. ffmpeg builds without fontconfig need a \a fontPath.
+		static Filter timecode( const ci::ivec2 &position, int32_t fontSize = 24, const ci::fs::path &fontPath = ci::fs::path() );
+		//! Overlays a still image such as a watermark, respecting its alpha. Negative coordinates are measured from the right and bottom edges.
+		static Filter overlay( const ci::fs::path &imagePath, const ci::ivec2 &position );
+		//! Letterboxes the frame, centered, into \a size.
+		static Filter pad( const ci::ivec2 &size, const ci::Color8u &color = ci::Color8u( 0, 0, 0 ) );
+		//! A -1 component keeps the aspect ratio, rounded to an even size.
+		static Filter scale( const ci::ivec2 &size );
+		static Filter fps( float frameRate );
+
+		Type getType() const { return mType; }
+
+	 private:
+		Filter( Type type ) : mType( type ) {}
+
+		Type mType;
+		ci::ivec2 mPosition;
+		ci::ivec2 mSize;
+		int32_t mFontSize = 24;
+		ci::fs::path mPath;
+		ci::Color8u mColor;
+		float mFrameRate = 0.0f;
+
+		friend class FFmpegMovieWriter;
+	};
+
+	//! Audio source recorded as a separate stream of the movie, see Format::audioTrack().
+	struct AudioTrack
+	{
+		AudioTrack( size_t sampleRate = 44100, size_t numChannels = 2 ) :
+			mSampleRate( sampleRate ), mNumChannels( numChannels ) {}
+
+		size_t mSampleRate;
+		size_t mNumChannels;
+	};
+
 	class Format
 	{
 	 public:
+		//! Pixel format of the video pipe. PIXEL_FORMAT_AUTO streams 8-bit frames in the video channel order, the others are packed from 8-bit, 16-bit or float surfaces on the video thread.
+		enum PixelFormat { PIXEL_FORMAT_AUTO, PIXEL_FORMAT_RGB48, PIXEL_FORMAT_GBRP16, PIXEL_FORMAT_YUV420P10, PIXEL_FORMAT_P010 };
+		//! Transfer function applied to linear light input while packing high bit depth frames. The input is Rec.709, PQ and HLG convert it to BT.2020 primaries.
+		enum TransferFunction { TRANSFER_LINEAR, TRANSFER_SRGB, TRANSFER_BT709, TRANSFER_PQ, TRANSFER_HLG };
+		//! What addFrame() does when the FFmpegMemoryGovernor budget is exhausted. Streaming formats never block and drop the oldest frame instead. The policy only applies to video: addAudioBuffer() is called from the audio thread and never blocks, so audio that does not fit the budget or the queue is dropped under every policy and written as silence.
+		enum MemoryPolicy { MEMORY_POLICY_BLOCK, MEMORY_POLICY_DROP_NEWEST, MEMORY_POLICY_DROP_OLDEST };
+
 		Format();
 		Format( const Format &format );
 
 		const Format & operator=( const Format &format );
 
+		//! Path of the ffmpeg executable, looked up in the login shell PATH unless absolute.
+		Format & ffmpegPath( const ci::fs::path &path ) { mPathFFmpeg = path; return *this; }
+		ci::fs::path getFFmpegPath() const { return mPathFFmpeg; }
+		void setFFmpegPath( const ci::fs::path &path ) { mPathFFmpeg = path; }
+
+		Format & verbose( bool verbose = true ) { mVerbose = verbose; return *this; }
+		bool getVerbose() const { return mVerbose; }
+		void setVerbose( bool verbose = true ) { mVerbose = verbose; }
+
 		Format & recordVideo( bool recordVideo = true ) { mRecordVideo = recordVideo; return *this; }
 		bool getRecordVideo() const { return mRecordVideo; }
 		void setRecordVideo( bool recordVideo = true ) { mRecordVideo = recordVideo; }
@@ -77,10 +154,59 @@ class FFmpegMovieWriter
 		size_t getNumAudioInputChannels() const { return mNumAudioInputChannels; }
 		void setNumAudioInputChannels( size_t numInputChannels ) { mNumAudioInputChannels = numInputChannels; }
 
+		//! Adds an audio track, addAudioBuffer() numbers the tracks in the order they were added. Every track is encoded with the same codec into its own stream. Without tracks, recordAudio() records a single track with the audio sample rate and input channels above.
+		Format & audioTrack( size_t sampleRate, size_t numChannels ) { mAudioTracks.push_back( AudioTrack( sampleRate, numChannels ) ); return *this; }
+		const std::vector< AudioTrack > & getAudioTracks() const { return mAudioTracks; }
+		void setAudioTracks( const std::vector< AudioTrack > &audioTracks ) { mAudioTracks = audioTracks; }
+
+		Format & codecVideo( const std::string &codec ) { mCodecVideo = codec; return *this; }
+		std::string getCodecVideo() const { return mCodecVideo; }
+		void setCodecVideo( const std::string &codec ) { mCodecVideo = codec; }
+
+		Format & codecAudio( const std::string &codec ) { mCodecAudio = codec; return *this; }
+		std::string getCodecAudio() const { return mCodecAudio; }
+		void setCodecAudio( const std::string &codec ) { mCodecAudio = codec; }
+
 		Format & videoChannelOrder( const ci::SurfaceChannelOrder &channelOrder ) { mVideoChannelOrder = channelOrder; return *this; }
 		ci::SurfaceChannelOrder getVideoChannelOrder() const { return mVideoChannelOrder; }
 		void setVideoChannelOrder( const ci::SurfaceChannelOrder &channelOrder ) { mVideoChannelOrder = channelOrder; }
 
+		//! Streams to a URL such as udp://127.0.0.1:1234 or pipe:3 with low latency encoder and muxer settings and short queues that drop instead of blocking.
+		Format & streaming( bool streaming = true ) { mStreaming = streaming; return *this; }
+		bool getStreaming() const { return mStreaming; }
+		void setStreaming( bool streaming = true ) { mStreaming = streaming; }
+
+		Format & streamingFormat( const std::string &format ) { mStreamingFormat = format; return *this; }
+		std::string getStreamingFormat() const { return mStreamingFormat; }
+		void setStreamingFormat( const std::string &format ) { mStreamingFormat = format; }
+
+		//! Encodes to an MPEG-TS stream that is remuxed into the movie file, so rotate() can switch files at a keyframe without restarting the encoder.
+		Format & segmented( bool segmented = true ) { mSegmented = segmented; return *this; }
+		bool getSegmented() const { return mSegmented; }
+		void setSegmented( bool segmented = true ) { mSegmented = segmented; }
+
+		//! Records the lifecycle of every frame and audio block and writes it as a Chrome / Perfetto JSON trace to \a path when recording is done.
+		Format & tracePath( const ci::fs::path &path ) { mTracePath = path; return *this; }
+		ci::fs::path getTracePath() const { return mTracePath; }
+		void setTracePath( const ci::fs::path &path ) { mTracePath = path; }
+
+		//! Appends \a filter to the video filter chain, which runs in order. The chain is validated when the writer is created.
+		Format & filter( const Filter &filter ) { mFilters.push_back( filter ); return *this; }
+		const std::vector< Filter > & getFilters() const { return mFilters; }
+		void setFilters( const std::vector< Filter > &filters ) { mFilters = filters; }
+
+		Format & memoryPolicy( MemoryPolicy policy ) { mMemoryPolicy = policy; return *this; }
+		MemoryPolicy getMemoryPolicy() const { return mMemoryPolicy; }
+		void setMemoryPolicy( MemoryPolicy policy ) { mMemoryPolicy = policy; }
+
+		Format & videoPixelFormat( PixelFormat pixelFormat ) { mVideoPixelFormat = pixelFormat; return *this; }
+		PixelFormat getVideoPixelFormat() const { return mVideoPixelFormat; }
+		void setVideoPixelFormat( PixelFormat pixelFormat ) { mVideoPixelFormat = pixelFormat; }
+
+		Format & videoTransferFunction( TransferFunction transferFunction ) { mVideoTransferFunction = transferFunction; return *this; }
+		TransferFunction getVideoTransferFunction() const { return mVideoTransferFunction; }
+		void setVideoTransferFunction( TransferFunction transferFunction ) { mVideoTransferFunction = transferFunction; }
+
 	private:
 		ci::fs::path mPathFFmpeg = "ffmpeg";
 		std::string mCodecVideo = "mpeg4";
@@ -91,25 +217,91 @@ class FFmpegMovieWriter
 
 		size_t mAudioSampleRate = 44100;
 		size_t mNumAudioInputChannels = 2;
+		std::vector< AudioTrack > mAudioTracks;
 
 		ci::SurfaceChannelOrder mVideoChannelOrder = ci::SurfaceChannelOrder( ci::SurfaceChannelOrder::RGB );
+		PixelFormat mVideoPixelFormat = PIXEL_FORMAT_AUTO;
+		TransferFunction mVideoTransferFunction = TRANSFER_LINEAR;
 
 		bool mRecordVideo = true;
 		bool mRecordAudio = false;
 		bool mVerbose = false;
 
+		bool mStreaming = false;
+		std::string mStreamingFormat = "mpegts";
+
+		bool mSegmented = false;
+
+		MemoryPolicy mMemoryPolicy = MEMORY_POLICY_BLOCK;
+
+		std::vector< Filter > mFilters;
+
+		ci::fs::path mTracePath;
+
 		friend class FFmpegMovieWriter;
 	};
 
+	//! Releasing the last reference finalizes the writer on a background thread instead of blocking. Throws FFmpegMovieWriterExc if the filter chain or the audio tracks are invalid, or ffmpeg lacks one of the filters.
 	static FFmpegMovieWriterRef create( const ci::fs::path &path,
-			int32_t width, int32_t height, const Format &format )
-	{ return FFmpegMovieWriterRef( new FFmpegMovieWriter( path,
-				width, height, format ) ); }
+			int32_t width, int32_t height, const Format &format );
 
 	~FFmpegMovieWriter();
 
+	struct FinalizeResult
+	{
+		size_t mNumVideoFramesWritten = 0;
+		//! Samples written to the first audio track.
+		size_t mNumAudioSamplesWritten = 0;
+		std::vector< size_t > mNumAudioTrackSamplesWritten;
+		//! Frames that came out of the filter chain, only counted with filters or tracing.
+		size_t mNumVideoFramesEncoded = 0;
+		uintmax_t mFileSize = 0;
+		int mExitStatus = -1;
+	};
+
+	//! Writes every queued frame and sample, closes the pipes and waits for ffmpeg to finish the file. Frames added afterwards are dropped.
+	std::shared_future< FinalizeResult > finalize();
+
 	void addFrame( ci::Surface8uRef surface );
+	//! Records the \a area of \a surface without copying it.
+	void addFrame( ci::Surface8uRef surface, const ci::Area &area );
+	//! Records 8-bit pixels from caller memory without copying them. Rows are \a rowBytes apart, \a releaseFn is called once the writer no longer needs \a data. Frames without \a data or with rows shorter than \a width pixels are dropped, and so are frames whose \a channelOrder does not match the video channel order with PIXEL_FORMAT_AUTO.
+	void addFrame( const void *data, int32_t width, int32_t height, ptrdiff_t rowBytes,
+			const ci::SurfaceChannelOrder &channelOrder, const std::function< void() > &releaseFn );
+	//! High bit depth frames require a pixel format other than PIXEL_FORMAT_AUTO.
+	void addFrame( ci::Surface16uRef surface );
+	void addFrame( ci::Surface32fRef surface );
+	//! Records \a buffer into the first audio track.
 	void addAudioBuffer( const ci::audio::Buffer *buffer );
+	//! Records \a buffer into the audio track \a trackId. Channels the buffer does not have are recorded as silence, extra channels are ignored. The first buffer of a track that starts late ends at the current position of the first track, which also paces the video.
+	void addAudioBuffer( size_t trackId, const ci::audio::Buffer *buffer );
+	size_t getNumAudioTracks() const { return mAudioTracks.size(); }
+
+	//! Frames and audio buffers are ignored while paused, the encoder keeps running and the output continues without a gap on resume().
+	void pause();
+	void resume();
+	bool isPaused() const { return mPaused; }
+
+	//! Closes the current file at the next keyframe and continues recording into \a path. Requires a segmented format.
+	void rotate( const ci::fs::path &path );
+
+	//! Frames and audio buffers dropped because the streaming queues or the memory budget were full. Dropped audio is written as silence and, when recording audio, a dropped frame is replaced by repeating a newer one, so the two stay in sync.
+	size_t getNumVideoFramesDropped() const { return mNumVideoFramesDropped; }
+	size_t getNumAudioFramesDropped() const { return mNumAudioFramesDropped; }
+	//! Frames repeated or skipped to keep the video in sync with the recorded audio.
+	size_t getNumVideoFramesRepeated() const { return mNumVideoFramesRepeated; }
+	size_t getNumVideoFramesSkipped() const { return mNumVideoFramesSkipped; }
+
+	//! The -filter_complex graph built from the Format filters, empty without filters.
+	const std::string & getFilterGraph() const { return mFilterGraph; }
+	//! Frame size and rate after the filter chain.
+	ci::ivec2 getOutputSize() const { return mOutputSize; }
+	float getOutputFrameRate() const { return mOutputFrameRate; }
+	size_t getNumVideoFramesEncoded() const { return mNumVideoFramesEncoded; }
+
+	//! Bytes of queued frames and conversion buffers charged to the FFmpegMemoryGovernor budget.
+	size_t getMemoryUsage() const { return mMemory->getUsage(); }
+	size_t getPeakMemoryUsage() const { return mMemory->getPeakUsage(); }
 
  protected:
 	FFmpegMovieWriter( const ci::fs::path &path, int32_t width, int32_t height,
@@ -117,7 +309,18 @@ class FFmpegMovieWriter
 
 	const Format mFormat;
 
-	pid_t mFFmpegPid;
+	pid_t mFFmpegPid = -1;
+	std::atomic< bool > mFFmpegExited;
+	int mFFmpegExitStatus;
+
+	void finalizeThreadFn();
+	std::shared_ptr< std::thread > mThreadFinalize;
+	std::mutex mFinalizeMutex;
+	std::atomic< bool > mFinalizing;
+	std::promise< FinalizeResult > mFinalizePromise;
+	std::shared_future< FinalizeResult > mFinalizeResult;
+
+	int openPipe( const ci::fs::path &pipe );
 
 	void setupFFmpeg();
 	void cleanupFFmpeg();
@@ -125,6 +328,41 @@ class FFmpegMovieWriter
 	std::shared_ptr< std::thread > mThreadFFmpeg;
 	std::atomic< bool > mThreadFFmpegInitialized;
 
+	FFmpegTracerRef mTracer;
+	FFmpegMemoryGovernor::ClientRef mMemory;
+
+	ci::fs::path mPipeProgress;
+	std::atomic< size_t > mNumVideoFramesEncoded;
+	//! Trace ids of the frames written to the video pipe waiting for their progress report, in the order they were written.
+	std::deque< uint64_t > mVideoIdsWritten;
+	std::mutex mVideoIdsWrittenMutex;
+
+	void buildFilterGraph();
+	std::string mFilterGraph;
+	std::vector< ci::fs::path > mFilterInputs;
+	ci::ivec2 mOutputSize;
+	float mOutputFrameRate;
+
+	void setupProgressThread();
+	void cleanupProgressThread();
+	void progressThreadFn();
+	std::shared_ptr< std::thread > mThreadProgress;
+	std::atomic< bool > mProgressThreadShouldQuit;
+
+	bool isSegmented() const;
+	pid_t spawnRemuxer( const ci::fs::path &path, int *fd );
+	void setupSegmentThread();
+	void cleanupSegmentThread();
+	void segmentThreadFn();
+	std::shared_ptr< std::thread > mThreadSegment;
+	int mSegmentPipe = -1;
+	int mSegmentPipeEncoder = -1;
+
+	std::mutex mRotateMutex;
+	ci::fs::path mRotatePath;
+	std::atomic< bool > mRotatePending;
+	std::atomic< bool > mPaused;
+
 	ci::fs::path mPathMovie;
 	int32_t mMovieWidth;
 	int32_t mMovieHeight;
@@ -137,9 +375,69 @@ class FFmpegMovieWriter
 	void cleanupVideoThread();
 	void videoThreadFn();
 	std::shared_ptr< std::thread > mThreadVideo;
-	bool mVideoThreadShouldQuit;
 
-	ci::ConcurrentCircularBuffer< ci::Surface8uRef > *mVideoFrames = nullptr;
+	struct VideoFrame
+	{
+		enum Depth { DEPTH_8U, DEPTH_16U, DEPTH_32F };
+
+		uint64_t mId = 0;
+		//! Keeps the pixel data alive while the frame is queued.
+		std::shared_ptr< const void > mOwner;
+		const uint8_t *mData = nullptr;
+		int32_t mWidth = 0;
+		int32_t mHeight = 0;
+		ptrdiff_t mRowBytes = 0;
+		Depth mDepth = DEPTH_8U;
+		//! Pixel increment and channel offsets in components.
+		uint8_t mPixelInc = 0;
+		uint8_t mRedOffset = 0;
+		uint8_t mGreenOffset = 0;
+		uint8_t mBlueOffset = 0;
+		//! Written this many times in a row to keep up with the audio.
+		size_t mNumCopies = 1;
+		//! Charged to the memory budget while the frame is queued.
+		size_t mNumBytes = 0;
+
+		explicit operator bool() const { return mData != nullptr; }
+	};
+
+	template< typename T >
+	static VideoFrame createVideoFrame( const std::shared_ptr< ci::SurfaceT< T > > &surface,
+			typename VideoFrame::Depth depth );
+	void addVideoFrame( const VideoFrame &frame );
+	//! Charges \a frame to the memory budget, dropping queued frames under MEMORY_POLICY_DROP_OLDEST.
+	bool acquireVideoMemory( VideoFrame *frame );
+	//! Releases a queued frame that will not be written, \a survivor is repeated in its place when recording audio.
+	void dropVideoFrame( const VideoFrame &frame, VideoFrame *survivor );
+
+	bool writeVideoRows( int fd, const uint8_t *data, size_t rowSize, ptrdiff_t rowBytes,
+			int32_t numRows, uint64_t id );
+	std::vector< iovec > mVideoIovecs;
+
+	size_t getPackedFrameSize() const;
+	static size_t getPackScratchSize( int32_t width );
+	void packVideoFrame( const VideoFrame &frame );
+	//! Packs band \a band of \a numBands bands of whole row pairs of \a frame.
+	void packVideoBand( const VideoFrame &frame, int32_t band, int32_t numBands );
+	//! Packs rows [\a y0, \a y1) of \a frame, \a y0 is even.
+	void packVideoRows( const VideoFrame &frame, int32_t y0, int32_t y1, float *scratch );
+	std::vector< uint8_t > mPackBuffer;
+	std::vector< float > mPackRows;
+	unsigned mNumPackThreads = 1;
+
+	//! Workers packing the bands after the first one, which is packed on the video thread. They live as long as the video thread.
+	void packThreadFn( int32_t band );
+	std::vector< std::shared_ptr< std::thread > > mPackThreads;
+	std::mutex mPackMutex;
+	std::condition_variable mPackCondition;
+	std::condition_variable mPackDoneCondition;
+	const VideoFrame *mPackFrame = nullptr;
+	int32_t mNumPackBands = 0;
+	int32_t mNumPackBandsPending = 0;
+	uint64_t mPackGeneration = 0;
+	bool mPackThreadsShouldQuit = false;
+
+	ci::ConcurrentCircularBuffer< VideoFrame > *mVideoFrames = nullptr;
 
 	ci::fs::path mPipeAudio;
 
@@ -147,19 +445,71 @@ class FFmpegMovieWriter
 	void cleanupAudioThread();
 	void audioThreadFn();
 	std::shared_ptr< std::thread > mThreadAudio;
-	bool mAudioThreadShouldQuit;
 
+	//! Interleaved samples of one track. Frames are recycled through the pool, so the audio thread does not allocate.
 	struct AudioFrame
 	{
-		float *mData;
-		size_t mSize;
+		~AudioFrame() { delete [] mData; }
+
+		float *mData = nullptr;
+		size_t mCapacity = 0;
+		size_t mSize = 0;
+		size_t mNumFrames = 0;
+		size_t mTrack = 0;
+		//! Index of the first sample in the track.
+		uint64_t mPosition = 0;
+		uint64_t mId = 0;
 	};
 
 	ci::ConcurrentCircularBuffer< AudioFrame * > *mAudioFrames = nullptr;
-	//ci::ConcurrentCircularBuffer< ci::audio::BufferInterleaved * > *mAudioFrames = nullptr;
+	ci::ConcurrentCircularBuffer< AudioFrame * > *mAudioFramePool = nullptr;
+
+	//! Tracks may be fed from different threads, the recorded sample counts and start times are atomic so audio callbacks never wait for a lock.
+	struct AudioTrackState
+	{
+		static constexpr uint64_t kNotStarted = ~uint64_t( 0 );
+
+		bool isStarted() const { return mStartTime != kNotStarted; }
+		//! Milliseconds on the recording timeline of the sample at \a position.
+		uint64_t getTimestamp( uint64_t position ) const
+		{
+			const uint64_t startTime = mStartTime;
+			return ( startTime == kNotStarted ? 0 : startTime ) + position * 1000 / mSampleRate;
+		}
+		uint64_t getTime() const { return getTimestamp( mNumSamplesRecorded ); }
+
+		size_t mSampleRate = 0;
+		size_t mNumChannels = 0;
+		//! Set once by the first buffer of the track.
+		std::atomic< uint64_t > mStartTime;
+		//! Includes dropped buffers.
+		std::atomic< uint64_t > mNumSamplesRecorded;
+		//! Includes the silence written for dropped buffers.
+		std::atomic< size_t > mNumSamplesWritten;
+	};
+
+	//! Validates the audio tracks and builds the header of the audio stream.
+	void buildAudioTracks();
+	std::vector< AudioTrackState > mAudioTracks;
+	//! Matroska header declaring every track, all tracks are multiplexed through the audio pipe as timestamped blocks.
+	std::vector< uint8_t > mAudioStreamHeader;
+
+	//! Writes \a numFrames samples of \a trackId starting at \a position as one block, opening a new cluster when needed.
+	bool writeAudioBlock( int fd, size_t trackId, uint64_t position, const float *data, size_t numFrames );
+	//! Writes silence until the track reaches \a position, in place of dropped buffers.
+	bool writeAudioSilence( int fd, size_t trackId, uint64_t position );
+	bool mAudioClusterStarted = false;
+	uint64_t mAudioClusterTimestamp = 0;
+	std::vector< float > mAudioSilence;
 
-	size_t mNumAudioSamplesRecorded = 0;
 	size_t mNumVideoFramesRecorded = 0;
+	uint64_t mNumVideoFramesSubmitted = 0;
+	std::atomic< uint64_t > mNumAudioFramesSubmitted;
+	std::atomic< size_t > mNumVideoFramesWritten;
+	std::atomic< size_t > mNumVideoFramesDropped;
+	std::atomic< size_t > mNumAudioFramesDropped;
+	std::atomic< size_t > mNumVideoFramesRepeated;
+	std::atomic< size_t > mNumVideoFramesSkipped;
 };
 
 }
@@ -0,0 +1,252 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <fstream>
+
+#include "cinder/Log.h"
+
+#include "FFmpegTracer.h"
+
+namespace mndl {
+
+namespace {
+
+std::atomic< uint64_t > sTracerSerial( 0 );
+
+struct ThreadBufferCache
+{
+	uint64_t mSerial = 0;
+	void *mBuffer = nullptr;
+};
+
+// one slot per tracer serial, so a thread recording to several writers keeps
+// all of their buffers cached
+const size_t kThreadBufferCacheSize = 16;
+thread_local ThreadBufferCache tThreadBufferCache[ kThreadBufferCacheSize ];
+
+const char *getStreamName( uint8_t stream )
+{
+	return stream == FFmpegTracer::STREAM_VIDEO ? "video" : "audio";
+}
+
+} // anonymous namespace
+
+FFmpegTracer::FFmpegTracer( size_t maxEventsPerThread ) :
+	mMaxEventsPerThread( std::max< size_t >( maxEventsPerThread, 1 ) ),
+	mSerial( ++sTracerSerial ),
+	mStartTime( Clock::now() )
+{ }
+
+FFmpegTracer::ThreadBuffer *FFmpegTracer::getThreadBuffer()
+{
+	// the serial is unique per tracer, so a cached buffer of a destroyed
+	// tracer is never reused by a new one at the same address
+	ThreadBufferCache &cache = tThreadBufferCache[ mSerial % kThreadBufferCacheSize ];
+	if ( cache.mSerial == mSerial )
+	{
+		return static_cast< ThreadBuffer * >( cache.mBuffer );
+	}
+
+	std::lock_guard< std::mutex > lock( mMutex );
+	const std::thread::id threadId = std::this_thread::get_id();
+	ThreadBuffer *buffer = nullptr;
+	for ( const auto &threadBuffer : mThreadBuffers )
+	{
+		if ( threadBuffer->mThreadId == threadId )
+		{
+			buffer = threadBuffer.get();
+			break;
+		}
+	}
+
+	if ( ! buffer )
+	{
+		mThreadBuffers.emplace_back( new ThreadBuffer );
+		buffer = mThreadBuffers.back().get();
+		buffer->mThreadId = threadId;
+		buffer->mTid = uint32_t( mThreadBuffers.size() );
+		buffer->mEvents.reset( new Event[ mMaxEventsPerThread ] );
+		buffer->mNumEvents = 0;
+	}
+
+	cache.mSerial = mSerial;
+	cache.mBuffer = buffer;
+	return buffer;
+}
+
+void FFmpegTracer::record( Stream stream, uint64_t id, Stage stage )
+{
+	ThreadBuffer *buffer = getThreadBuffer();
+
+	// only the owning thread appends, readers see events up to mNumEvents
+	size_t index = buffer->mNumEvents.load( std::memory_order_relaxed );
+	Event &event = buffer->mEvents[ index % mMaxEventsPerThread ];
+	event.mTime = std::chrono::duration_cast< std::chrono::nanoseconds >(
+			Clock::now() - mStartTime ).count();
+	event.mId = id;
+	event.mStream = uint8_t( stream );
+	event.mStage = uint8_t( stage );
+	buffer->mNumEvents.store( index + 1, std::memory_order_release );
+}
+
+size_t FFmpegTracer::getNumEventsDropped() const
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	size_t numEventsDropped = 0;
+	for ( const auto &buffer : mThreadBuffers )
+	{
+		size_t numEvents = buffer->mNumEvents.load( std::memory_order_acquire );
+		numEventsDropped += numEvents - std::min( numEvents, mMaxEventsPerThread );
+	}
+	return numEventsDropped;
+}
+
+bool FFmpegTracer::write( const ci::fs::path &path ) const
+{
+	struct TracedEvent
+	{
+		Event mEvent;
+		uint32_t mTid;
+	};
+
+	std::vector< TracedEvent > events;
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		for ( const auto &buffer : mThreadBuffers )
+		{
+			// the oldest kept event first
+			size_t numEvents = buffer->mNumEvents.load( std::memory_order_acquire );
+			for ( size_t i = numEvents - std::min( numEvents, mMaxEventsPerThread ); i < numEvents; i++ )
+			{
+				events.push_back( { buffer->mEvents[ i % mMaxEventsPerThread ], buffer->mTid } );
+			}
+		}
+	}
+
+	std::sort( events.begin(), events.end(),
+			[]( const TracedEvent &a, const TracedEvent &b )
+			{
+				if ( a.mEvent.mStream != b.mEvent.mStream )
+				{
+					return a.mEvent.mStream < b.mEvent.mStream;
+				}
+				if ( a.mEvent.mId != b.mEvent.mId )
+				{
+					return a.mEvent.mId < b.mEvent.mId;
+				}
+				return a.mEvent.mTime < b.mEvent.mTime;
+			} );
+
+	std::ofstream ofs( path.string() );
+	if ( ! ofs )
+	{
+		CI_LOG_E( "Failed to write trace to " << path );
+		return false;
+	}
+
+	ofs << "{\"traceEvents\":[\n";
+	bool first = true;
+	auto emit =
+		[ &ofs, &first ]( const std::string &json )
+		{
+			ofs << ( first ? "" : ",\n" ) << json;
+			first = false;
+		};
+
+	auto ts =
+		[]( uint64_t time )
+		{
+			return std::to_string( time / 1000 ) + "." + std::to_string( time % 1000 / 100 );
+		};
+
+	// thread slices for the stages that happen on one thread
+	auto slice =
+		[ &emit, &ts ]( const char *name, const char *cat, const TracedEvent *begin,
+				const TracedEvent *end, uint64_t id )
+		{
+			if ( ! begin || ! end || begin->mTid != end->mTid )
+			{
+				return;
+			}
+			emit( std::string( "{\"name\":\"" ) + name + "\",\"cat\":\"" + cat +
+					"\",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string( begin->mTid ) +
+					",\"ts\":" + ts( begin->mEvent.mTime ) +
+					",\"dur\":" + ts( end->mEvent.mTime - begin->mEvent.mTime ) +
+					",\"args\":{\"id\":" + std::to_string( id ) + "}}" );
+		};
+
+	// async spans that follow a frame across threads
+	auto span =
+		[ &emit, &ts ]( const std::string &name, const char *cat, const TracedEvent *begin,
+				const TracedEvent *end, uint64_t id )
+		{
+			if ( ! begin || ! end )
+			{
+				return;
+			}
+			std::string common = std::string( "\"name\":\"" ) + name + "\",\"cat\":\"" + cat +
+				"\",\"pid\":1,\"tid\":" + std::to_string( begin->mTid ) +
+				",\"id\":\"" + cat + std::to_string( id ) + "\"";
+			emit( "{" + common + ",\"ph\":\"b\",\"ts\":" + ts( begin->mEvent.mTime ) + "}" );
+			emit( "{" + common + ",\"ph\":\"e\",\"ts\":" + ts( end->mEvent.mTime ) + "}" );
+		};
+
+	size_t i = 0;
+	while ( i < events.size() )
+	{
+		const TracedEvent *stages[ STAGE_ENCODED + 1 ] = {};
+		const uint8_t stream = events[ i ].mEvent.mStream;
+		const uint64_t id = events[ i ].mEvent.mId;
+		const TracedEvent *firstEvent = &events[ i ];
+		const TracedEvent *lastEvent = firstEvent;
+
+		for ( ; i < events.size() && events[ i ].mEvent.mStream == stream &&
+				events[ i ].mEvent.mId == id; i++ )
+		{
+			stages[ events[ i ].mEvent.mStage ] = &events[ i ];
+			lastEvent = &events[ i ];
+		}
+
+		const char *cat = getStreamName( stream );
+		span( std::string( cat ) + " " + std::to_string( id ), cat, firstEvent, lastEvent, id );
+		span( "queued", cat, stages[ STAGE_ENQUEUE ], stages[ STAGE_DEQUEUE ], id );
+		span( "encoding", cat, stages[ STAGE_WRITE_END ], stages[ STAGE_ENCODED ], id );
+		slice( "submit", cat, stages[ STAGE_SUBMIT ], stages[ STAGE_ENQUEUE ], id );
+		slice( "prepare", cat, stages[ STAGE_DEQUEUE ], stages[ STAGE_WRITE_BEGIN ], id );
+		slice( "write", cat, stages[ STAGE_WRITE_BEGIN ], stages[ STAGE_WRITE_END ], id );
+	}
+
+	const size_t numEventsDropped = getNumEventsDropped();
+	if ( numEventsDropped > 0 )
+	{
+		CI_LOG_W( "Trace kept the last " << mMaxEventsPerThread << " events per thread, " <<
+				numEventsDropped << " older events were dropped" );
+	}
+
+	ofs << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"maxEventsPerThread\":\"" <<
+		mMaxEventsPerThread << "\",\"eventsDropped\":\"" << numEventsDropped << "\"}}\n";
+	return true;
+}
+
+}
@@ -0,0 +1,92 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cinder/Filesystem.h"
+
+namespace mndl {
+
+typedef std::shared_ptr< class FFmpegTracer > FFmpegTracerRef;
+
+//! Records the lifecycle of video frames and audio blocks. Every thread
+//! appends to its own ring buffer without locking, which keeps the most
+//! recent events. The buffers are written as a Chrome / Perfetto JSON trace
+//! when recording is done.
+class FFmpegTracer
+{
+ public:
+	enum Stream { STREAM_VIDEO, STREAM_AUDIO };
+	enum Stage { STAGE_SUBMIT, STAGE_ENQUEUE, STAGE_DEQUEUE, STAGE_WRITE_BEGIN,
+		STAGE_WRITE_END, STAGE_ENCODED };
+
+	static FFmpegTracerRef create( size_t maxEventsPerThread = 1 << 16 )
+	{ return FFmpegTracerRef( new FFmpegTracer( maxEventsPerThread ) ); }
+
+	void record( Stream stream, uint64_t id, Stage stage );
+
+	//! Older events overwritten in the per thread buffers.
+	size_t getNumEventsDropped() const;
+
+	bool write( const ci::fs::path &path ) const;
+
+ protected:
+	FFmpegTracer( size_t maxEventsPerThread );
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Event
+	{
+		uint64_t mTime;
+		uint64_t mId;
+		uint8_t mStream;
+		uint8_t mStage;
+	};
+
+	struct ThreadBuffer
+	{
+		std::thread::id mThreadId;
+		uint32_t mTid;
+		std::unique_ptr< Event[] > mEvents;
+		//! Events recorded so far, the last mMaxEventsPerThread are kept.
+		std::atomic< size_t > mNumEvents;
+	};
+
+	ThreadBuffer *getThreadBuffer();
+
+	const size_t mMaxEventsPerThread;
+	const uint64_t mSerial;
+	const Clock::time_point mStartTime;
+
+	mutable std::mutex mMutex;
+	std::vector< std::unique_ptr< ThreadBuffer > > mThreadBuffers;
+};
+
+}
@@ -0,0 +1,195 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include "FFmpegUtils.h"
+
+extern char **environ;
+
+namespace mndl {
+
+namespace detail {
+
+namespace {
+
+pid_t spawn( const char *file, char *const argv[], int stdinFd, int stdoutFd )
+{
+	posix_spawn_file_actions_t fileActions;
+	posix_spawn_file_actions_init( &fileActions );
+	if ( stdinFd >= 0 )
+	{
+		posix_spawn_file_actions_adddup2( &fileActions, stdinFd, STDIN_FILENO );
+	}
+	if ( stdoutFd >= 0 )
+	{
+		posix_spawn_file_actions_adddup2( &fileActions, stdoutFd, STDOUT_FILENO );
+	}
+
+	pid_t pid = -1;
+	int result = posix_spawnp( &pid, file, &fileActions, nullptr, argv, environ );
+	posix_spawn_file_actions_destroy( &fileActions );
+	if ( result != 0 )
+	{
+		errno = result;
+		return -1;
+	}
+	return pid;
+}
+
+} // anonymous namespace
+
+pid_t spawnShellCommand( const std::string &command, int stdinFd, int stdoutFd )
+{
+	std::string shell = "bash";
+	std::string login = "--login";
+	std::string option = "-c";
+	char *argv[] = { &shell[ 0 ], &login[ 0 ], &option[ 0 ],
+		const_cast< char * >( command.c_str() ), nullptr };
+
+	return spawn( "bash", argv, stdinFd, stdoutFd );
+}
+
+pid_t spawnProcess( const std::vector< std::string > &args, int stdinFd, int stdoutFd )
+{
+	if ( args.empty() )
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	std::vector< char * > argv;
+	for ( const auto &arg : args )
+	{
+		argv.push_back( const_cast< char * >( arg.c_str() ) );
+	}
+	argv.push_back( nullptr );
+
+	return spawn( argv[ 0 ], argv.data(), stdinFd, stdoutFd );
+}
+
+bool runCommand( const std::vector< std::string > &args, std::string *output )
+{
+	int fds[ 2 ];
+	if ( ::pipe( fds ) != 0 )
+	{
+		return false;
+	}
+	::fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+	::fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+
+	pid_t pid = spawnProcess( args, -1, fds[ 1 ] );
+	::close( fds[ 1 ] );
+	if ( pid <= 0 )
+	{
+		int serrno = errno;
+		::close( fds[ 0 ] );
+		errno = serrno;
+		return false;
+	}
+
+	char buffer[ 4096 ];
+	ssize_t bytesRead;
+	while ( ( bytesRead = ::read( fds[ 0 ], buffer, sizeof( buffer ) ) ) != 0 )
+	{
+		if ( bytesRead > 0 )
+		{
+			output->append( buffer, size_t( bytesRead ) );
+		}
+		else
+		if ( errno != EINTR )
+		{
+			break;
+		}
+	}
+	::close( fds[ 0 ] );
+
+	int status = 0;
+	while ( ::waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+	{ }
+	return true;
+}
+
+std::string findExecutable( const ci::fs::path &executable )
+{
+	if ( executable.has_parent_path() )
+	{
+		return executable.string();
+	}
+
+	static std::mutex sMutex;
+	static std::map< std::string, std::string > sPaths;
+
+	std::lock_guard< std::mutex > lock( sMutex );
+	auto it = sPaths.find( executable.string() );
+	if ( it != sPaths.end() )
+	{
+		return it->second;
+	}
+
+	// falls back to the PATH of the app if the shell does not know it
+	std::string &path = sPaths[ executable.string() ];
+	path = executable.string();
+
+	std::stringstream cmd;
+	cmd << "command -v " << executable;
+	std::string output;
+	if ( ! runCommand( { "bash", "--login", "-c", cmd.str() }, &output ) )
+	{
+		return path;
+	}
+
+	// login scripts may print their own output before the path
+	std::istringstream lines( output );
+	std::string line;
+	while ( std::getline( lines, line ) )
+	{
+		if ( ! line.empty() && line[ 0 ] == '/' )
+		{
+			path = line;
+		}
+	}
+	return path;
+}
+
+std::string getPixelFormat( const ci::SurfaceChannelOrder &channelOrder )
+{
+	static const char *kPixelFormats[] = { "rgba", "bgra", "argb", "abgr",
+		"rgb0", "bgr0", "0rgb", "0bgr", "rgb24", "bgr24" };
+
+	const int code = channelOrder.getCode();
+	const int numPixelFormats = int( sizeof( kPixelFormats ) / sizeof( kPixelFormats[ 0 ] ) );
+	return code >= 0 && code < numPixelFormats ? kPixelFormats[ code ] : "rgb24";
+}
+
+} // namespace detail
+
+}
@@ -0,0 +1,53 @@
+/*
+ Copyright (c) 2019, Gabor Papp, All rights reserved.
+ This code is intended for use with the Cinder C++ library: http://libcinder.org
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+  * Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "cinder/Filesystem.h"
+#include "cinder/Surface.h"
+
+namespace mndl {
+
+//! Process and format helpers shared by the reader and the writer.
+namespace detail {
+
+//! Runs \a command through a login shell, so ffmpeg is found on the user's PATH even if the app was not launched from a terminal. The command should start with exec to make the returned pid ffmpeg's. Returns -1 and sets errno on failure.
+pid_t spawnShellCommand( const std::string &command, int stdinFd = -1, int stdoutFd = -1 );
+//! Starts \a args[ 0 ] without a shell, which saves the startup time of a login shell. Returns -1 and sets errno on failure.
+pid_t spawnProcess( const std::vector< std::string > &args, int stdinFd = -1, int stdoutFd = -1 );
+//! Runs \a args without a shell until they exit, their output is collected in \a output. Returns false and sets errno if they could not be started.
+bool runCommand( const std::vector< std::string > &args, std::string *output );
+//! Looks up \a executable on the PATH of a login shell once per name, so spawnProcess() finds the same binary as spawnShellCommand(). Paths with a directory are returned as they are.
+std::string findExecutable( const ci::fs::path &executable );
+
+//! Raw video pixel format of \a channelOrder, rgb24 for orders ffmpeg has no format for.
+std::string getPixelFormat( const ci::SurfaceChannelOrder &channelOrder );
+
+} // namespace detail
+
+}